@@ -0,0 +1,260 @@
+#include "Grid.h"
+#include "LevelSet.h"
+#include "SaveState.h"
+#include "Compress.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <codecvt>
+#include <locale>
+#include <pthread.h>
+
+// Headless solver benchmark. Runs a rule set, as exported by the "copy all
+// rules" button, over every level in levels.data the same way the robots do
+// and reports throughput as JSON.
+//
+//  BombeBench [-t threads] [-m game_mode] [-r region_limit] [-o out.json] rules.txt
+
+static pthread_mutex_t glob_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void global_mutex_lock()
+{
+    pthread_mutex_lock(&glob_mutex);
+}
+
+void global_mutex_unlock()
+{
+    pthread_mutex_unlock(&glob_mutex);
+}
+
+static uint64_t get_time_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct BenchLevel
+{
+    const std::string* level;
+    uint64_t time = 0;
+    unsigned regions = 0;
+    bool solved = false;
+    bool limited = false;
+};
+
+struct BenchThread
+{
+    pthread_t thread;
+    std::map<GridRule*, RuleProfile> profile;
+    std::map<GridRule*, int> used_count;
+    std::map<GridRule*, int> clear_count;
+};
+
+static std::list<GridRule> bench_rules;
+static std::vector<BenchLevel> bench_levels;
+static std::atomic<unsigned> next_level(0);
+static int region_limit = -1;
+
+static void* bench_thread(void* ptr)
+{
+    BenchThread* bt = (BenchThread*)ptr;
+    while (true)
+    {
+        unsigned index = next_level++;
+        if (index >= bench_levels.size())
+            break;
+        BenchLevel& lvl = bench_levels[index];
+        uint64_t start = get_time_ns();
+        Grid* grid = Grid::Load(*lvl.level);
+        while (true)
+        {
+            static const XYSet emptyFilter{};
+            int rep = advance_grid(grid, bench_rules, NULL, emptyFilter, emptyFilter, true);
+            if (rep == 0)
+            {
+                lvl.solved = grid->is_solved();
+                break;
+            }
+            if (region_limit >= 0 && int(grid->regions.size()) > region_limit)
+            {
+                lvl.limited = true;
+                break;
+            }
+        }
+        lvl.regions = grid->regions.size();
+        lvl.time = get_time_ns() - start;
+        grid->flush_rule_profiles();
+        for (auto [rule, count] : grid->level_used_count)
+            bt->used_count[rule] += count;
+        for (auto [rule, count] : grid->level_clear_count)
+            bt->clear_count[rule] += count;
+        for (auto& [rule, prof] : grid->level_profile)
+            bt->profile[rule].add(prof);
+        delete grid;
+    }
+    return NULL;
+}
+
+static std::string load_rules_json(std::string filename)
+{
+    std::ifstream loadfile(filename);
+    if (loadfile.fail())
+        throw(std::runtime_error("Could not open rules file"));
+    std::stringstream str_stream;
+    str_stream << loadfile.rdbuf();
+    std::string text = str_stream.str();
+
+    std::string comp;
+    std::wstring_convert<std::codecvt_utf8<char32_t>, char32_t> conv;
+    std::u32string s32 = conv.from_bytes(text);
+    for(uint32_t c : s32)
+    {
+        if ((c & 0xFF00) == 0x2800)
+            comp += char(c & 0xFF);
+    }
+    if (!comp.empty())
+        return decompress_string(comp);
+    while (!text.empty() && text[0] != '{')
+        text.erase(0, 1);
+    return text;
+}
+
+static uint64_t percentile(std::vector<uint64_t>& sorted, unsigned pct)
+{
+    if (sorted.empty())
+        return 0;
+    return sorted[std::min<size_t>(sorted.size() - 1, sorted.size() * pct / 100)];
+}
+
+int main(int argc, char* argv[])
+{
+    int thread_count = 1;
+    int game_mode = 0;
+    const char* rules_filename = NULL;
+    const char* out_filename = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-t") && i + 1 < argc)
+            thread_count = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-m") && i + 1 < argc)
+            game_mode = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-r") && i + 1 < argc)
+            region_limit = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+            out_filename = argv[++i];
+        else
+            rules_filename = argv[i];
+    }
+    if (!rules_filename || thread_count < 1)
+    {
+        printf("usage: %s [-t threads] [-m game_mode] [-r region_limit] [-o out.json] rules.txt\n", argv[0]);
+        return 1;
+    }
+
+    try
+    {
+        std::string json = load_rules_json(rules_filename);
+        SaveObjectMap* omap = SaveObject::load(json)->get_map();
+        SaveObjectList* rlist = omap->get_item("rules")->get_list();
+        for (unsigned i = 0; i < rlist->get_count(); i++)
+        {
+            // The robots are handed the live rules only.
+            GridRule rule(rlist->get_item(i));
+            if (!rule.deleted)
+                bench_rules.push_back(rule);
+        }
+        delete omap;
+    }
+    catch (const std::runtime_error& error)
+    {
+        std::cerr << error.what() << "\n";
+        return 1;
+    }
+
+    LevelSet::init_global();
+    for (int j = 0; j < GLBAL_LEVEL_SETS; j++)
+        for (LevelSet* level_set : ((game_mode == 4) ? second_global_level_sets : global_level_sets)[j])
+            for (const std::string& level : level_set->get_levels())
+                bench_levels.push_back(BenchLevel{&level});
+
+    std::vector<BenchThread> threads(thread_count);
+    uint64_t start = get_time_ns();
+    for (BenchThread& bt : threads)
+        pthread_create(&bt.thread, NULL, bench_thread, &bt);
+    for (BenchThread& bt : threads)
+        pthread_join(bt.thread, NULL);
+    uint64_t wall_time = get_time_ns() - start;
+
+    uint64_t total_regions = 0;
+    unsigned solved = 0;
+    unsigned limited = 0;
+    std::vector<uint64_t> times;
+    for (BenchLevel& lvl : bench_levels)
+    {
+        total_regions += lvl.regions;
+        solved += lvl.solved;
+        limited += lvl.limited;
+        times.push_back(lvl.time);
+    }
+    std::sort(times.begin(), times.end());
+    double secs = double(wall_time) / 1000000000;
+
+    SaveObjectMap* omap = new SaveObjectMap;
+    omap->add_num("threads", thread_count);
+    omap->add_num("game_mode", game_mode);
+    omap->add_num("rule_count", bench_rules.size());
+    omap->add_num("levels", bench_levels.size());
+    omap->add_num("solved", solved);
+    omap->add_num("region_limited", limited);
+    omap->add_num("regions", total_regions);
+    omap->add_num("wall_ns", wall_time);
+    omap->add_num("levels_per_sec", secs > 0 ? bench_levels.size() / secs : 0);
+    omap->add_num("regions_per_sec", secs > 0 ? total_regions / secs : 0);
+    omap->add_num("level_p50_ns", percentile(times, 50));
+    omap->add_num("level_p99_ns", percentile(times, 99));
+    omap->add_num("level_max_ns", times.empty() ? 0 : times.back());
+
+    SaveObjectList* rule_list = new SaveObjectList;
+    int index = 0;
+    for (GridRule& rule : bench_rules)
+    {
+        SaveObjectMap* rule_map = new SaveObjectMap;
+        RuleProfile prof;
+        int used = 0;
+        int cleared = 0;
+        for (BenchThread& bt : threads)
+        {
+            prof.add(bt.profile[&rule]);
+            used += bt.used_count[&rule];
+            cleared += bt.clear_count[&rule];
+        }
+        rule_map->add_num("index", index++);
+        rule_map->add_num("cpu_ms", prof.cpu_ms());
+        rule_map->add_num("used", used);
+        rule_map->add_num("cleared", cleared);
+        rule_map->add_item("profile", prof.save());
+        rule_list->add_item(rule_map);
+    }
+    omap->add_item("rules", rule_list);
+
+    if (out_filename)
+    {
+        std::ofstream outfile(out_filename);
+        omap->pretty_print(outfile);
+        outfile << "\n";
+    }
+    else
+    {
+        omap->pretty_print(std::cout);
+        std::cout << "\n";
+    }
+    delete omap;
+    return 0;
+}
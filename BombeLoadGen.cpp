@@ -0,0 +1,559 @@
+#include "BombeServer.h"
+#include "SaveState.h"
+#include "Compress.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <algorithm>
+#include <thread>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+// Drives a BombeServer with scores requests from many simulated players over
+// the same wire protocol as the game: a u32 length and a dictionary
+// compressed request, answered by one or more length prefixed messages
+// before the server closes the connection. Requests are started at a fixed
+// rate whether or not earlier ones have been answered, so a server that
+// falls behind shows up as growing latency and timeouts rather than as a
+// slower client. Reports throughput, latency percentiles and error counts
+// as JSON.
+//
+// Steam tickets are checked by the server, so -auth-port starts a stand-in
+// for the Steam endpoint which accepts every ticket. Run the server against
+// it, e.g.
+//
+//  BombeServer -auth-url http://127.0.0.1:18080/auth
+//  BombeLoadGen -auth-port 18080 -rate 2000 -duration 30
+//
+//  BombeLoadGen [-host addr] [-port n] [-players n] [-friends n] [-rate n]
+//               [-duration s] [-max-inflight n] [-timeout ms] [-legacy]
+//               [-json] [-auth-port n] [-o out.json]
+
+static const int game_modes = 5;
+static const int progress_lists = 5;
+static const uint64_t first_steam_id = 76561190000000000ULL;
+
+static uint64_t get_time_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Answers ticket checks the way the Steam endpoint does for a good ticket.
+// Tickets are "<steam_id>_loadgen", so the owner is read back from the
+// ticket itself.
+static void auth_stand_in(int listen_fd)
+{
+    while (true)
+    {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            return;
+        }
+        std::string request;
+        char buf[4096];
+        while (request.find("\r\n\r\n") == std::string::npos)
+        {
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0)
+                break;
+            request.append(buf, n);
+        }
+        std::string steam_id = "0";
+        size_t pos = request.find("ticket=");
+        if (pos != std::string::npos)
+        {
+            pos += 7;
+            size_t end = request.find_first_of("_& ", pos);
+            steam_id = request.substr(pos, end - pos);
+        }
+        std::string body = "{\"response\":{\"params\":{\"result\":\"OK\",\"steamid\":\"" + steam_id + "\"}}}";
+        std::string reply = "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nConnection: close\r\nContent-Length: " +
+                            std::to_string(body.length()) + "\r\n\r\n" + body;
+        send(fd, reply.data(), reply.length(), MSG_NOSIGNAL);
+        close(fd);
+    }
+}
+
+class Player
+{
+public:
+    uint64_t steam_id;
+    int game_mode;
+    std::vector<uint64_t> friends;
+    std::vector<std::vector<std::string>> progress;
+    int server_levels_version = -1;
+    int payload_version = -2;
+    std::string payload;
+
+    // The request as the game would send it, rebuilt only once the server
+    // has handed out a new level pool.
+    const std::string& get_payload(bool split, bool json)
+    {
+        if (payload_version == server_levels_version)
+            return payload;
+        SaveObjectMap* omap = new SaveObjectMap;
+        omap->add_string("command", "scores");
+        omap->add_num("steam_id", steam_id);
+        omap->add_string("steam_username", "loadgen" + std::to_string(steam_id - first_steam_id));
+        omap->add_string("steam_session", std::to_string(steam_id) + "_loadgen");
+        omap->add_num("demo", 0);
+        omap->add_num("playtest", 0);
+        omap->add_num("version", game_version);
+        omap->add_num("game_mode", game_mode);
+        if (split)
+            omap->add_num("shared_scores", 1);
+        SaveObjectList* pplist = new SaveObjectList;
+        for (std::vector<std::string>& sets : progress)
+        {
+            SaveObjectList* plist = new SaveObjectList;
+            for (std::string& s : sets)
+                plist->add_string(s);
+            pplist->add_item(plist);
+        }
+        omap->add_item("level_progress", pplist);
+        SaveObjectList* slist = new SaveObjectList;
+        for (uint64_t f : friends)
+            slist->add_num(f);
+        omap->add_item("friends", slist);
+        omap->add_num("server_levels_version", server_levels_version);
+        std::string comp = compress_string(json ? omap->to_string() : omap->to_binary(), COMPRESS_NETWORK);
+        delete omap;
+        uint32_t length = comp.length();
+        payload.assign((char*)&length, 4);
+        payload.append(comp);
+        payload_version = server_levels_version;
+        return payload;
+    }
+};
+
+class Request
+{
+public:
+    int fd;
+    unsigned player;
+    uint64_t start_ns;
+    std::string payload;
+    size_t sent = 0;
+    bool connected = false;
+    std::string inbuf;
+};
+
+class Stats
+{
+public:
+    uint64_t started = 0;
+    uint64_t completed = 0;
+    uint64_t skipped = 0;
+    uint64_t bytes_sent = 0;
+    uint64_t bytes_received = 0;
+    std::map<std::string, uint64_t> errors;
+    std::vector<uint64_t> latencies_ns;
+
+    uint64_t error_count()
+    {
+        uint64_t count = 0;
+        for (auto& [name, n] : errors)
+            count += n;
+        return count;
+    }
+};
+
+static uint64_t percentile(std::vector<uint64_t>& sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    size_t index = std::min(sorted.size() - 1, size_t(p * sorted.size()));
+    return sorted[index];
+}
+
+// Split a reply into its messages and check each one decodes. Returns an
+// error name, or an empty string if the reply is good.
+static std::string check_reply(const std::string& reply, Player& player)
+{
+    size_t pos = 0;
+    unsigned expected = 1;
+    for (unsigned index = 0; index < expected; index++)
+    {
+        if (reply.length() - pos < 4)
+            return index ? "short_reply" : "no_reply";
+        uint32_t length = *(uint32_t*)(reply.data() + pos);
+        pos += 4;
+        if (reply.length() - pos < length)
+            return "short_reply";
+        SaveObject* sob = NULL;
+        try
+        {
+            std::string decomp = decompress_string(reply.substr(pos, length));
+            sob = SaveObject::load(decomp);
+            SaveObjectMap* omap = sob->get_map();
+            if (index == 0)
+            {
+                if (omap->has_key("pirate"))
+                {
+                    delete sob;
+                    return "pirate";
+                }
+                if (omap->has_key("shared") && omap->get_num("shared"))
+                    expected++;
+                if (omap->has_key("levels") && omap->get_num("levels"))
+                    expected++;
+            }
+            if (omap->has_key("server_levels_version"))
+                player.server_levels_version = omap->get_num("server_levels_version");
+        }
+        catch (const std::runtime_error& error)
+        {
+            delete sob;
+            return "bad_reply";
+        }
+        delete sob;
+        pos += length;
+    }
+    return "";
+}
+
+int main(int argc, char* argv[])
+{
+    const char* host = "127.0.0.1";
+    int port = 42071;
+    unsigned player_count = 10000;
+    unsigned friend_count = 10;
+    double rate = 500;
+    double duration = 10;
+    unsigned max_inflight = 4000;
+    unsigned timeout_ms = 10000;
+    bool split = true;
+    bool json = false;
+    int auth_port = 0;
+    const char* out_filename = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-host") && i + 1 < argc)
+            host = argv[++i];
+        else if (!strcmp(argv[i], "-port") && i + 1 < argc)
+            port = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-players") && i + 1 < argc)
+            player_count = std::max(1, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-friends") && i + 1 < argc)
+            friend_count = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-rate") && i + 1 < argc)
+            rate = std::max(0.1, atof(argv[++i]));
+        else if (!strcmp(argv[i], "-duration") && i + 1 < argc)
+            duration = atof(argv[++i]);
+        else if (!strcmp(argv[i], "-max-inflight") && i + 1 < argc)
+            max_inflight = std::max(1, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-timeout") && i + 1 < argc)
+            timeout_ms = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-legacy"))
+            split = false;
+        else if (!strcmp(argv[i], "-json"))
+            json = true;
+        else if (!strcmp(argv[i], "-auth-port") && i + 1 < argc)
+            auth_port = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+            out_filename = argv[++i];
+        else
+        {
+            std::cerr << "Unknown option " << argv[i] << "\n";
+            return 1;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    struct rlimit fd_limit;
+    if (getrlimit(RLIMIT_NOFILE, &fd_limit) == 0 && fd_limit.rlim_cur < fd_limit.rlim_max)
+    {
+        fd_limit.rlim_cur = fd_limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &fd_limit);
+    }
+
+    struct sockaddr_in server_addr = {};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &server_addr.sin_addr) != 1)
+    {
+        std::cerr << "Bad host " << host << "\n";
+        return 1;
+    }
+
+    if (auth_port)
+    {
+        int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int reuse = 1;
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        struct sockaddr_in auth_addr = {};
+        auth_addr.sin_family = AF_INET;
+        auth_addr.sin_port = htons(auth_port);
+        auth_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(listen_fd, (struct sockaddr*)&auth_addr, sizeof(auth_addr)) || listen(listen_fd, SOMAXCONN))
+        {
+            perror("auth stand-in");
+            return 1;
+        }
+        std::thread(auth_stand_in, listen_fd).detach();
+    }
+
+    // Each player has a game mode, some friends and a fixed completion
+    // rate, so repeat requests send the same progress like a returning
+    // player would.
+    std::mt19937_64 rng(1);
+    std::vector<Player> players(player_count);
+    for (unsigned i = 0; i < player_count; i++)
+    {
+        Player& player = players[i];
+        player.steam_id = first_steam_id + i;
+        player.game_mode = rng() % game_modes;
+        for (unsigned j = 0; j < friend_count; j++)
+            player.friends.push_back(first_steam_id + rng() % player_count);
+        unsigned done_per_1000 = rng() % 1000;
+        player.progress.resize(progress_lists);
+        for (std::vector<std::string>& sets : player.progress)
+        {
+            sets.resize(30);
+            for (std::string& s : sets)
+                for (int k = 0; k < 40; k++)
+                    s += (rng() % 1000 < done_per_1000) ? '1' : '0';
+        }
+    }
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    std::unordered_map<int, Request> inflight;
+    std::deque<std::pair<uint64_t, int>> by_start;
+    Stats stats;
+    static const int max_events = 256;
+    struct epoll_event events[max_events];
+
+    auto finish = [&](Request& req, const std::string& error)
+    {
+        if (error.empty())
+        {
+            stats.completed++;
+            stats.latencies_ns.push_back(get_time_ns() - req.start_ns);
+        }
+        else
+            stats.errors[error]++;
+        int fd = req.fd;
+        close(fd);
+        inflight.erase(fd);
+    };
+
+    auto start_request = [&](uint64_t now)
+    {
+        unsigned index = rng() % player_count;
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+        {
+            stats.errors["socket"]++;
+            return;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        stats.started++;
+        if (connect(fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) && errno != EINPROGRESS)
+        {
+            stats.errors["connect"]++;
+            close(fd);
+            return;
+        }
+        Request& req = inflight[fd];
+        req.fd = fd;
+        req.player = index;
+        req.start_ns = now;
+        // Copied, since another request for the same player may rebuild the
+        // player's payload while this one is still being sent.
+        req.payload = players[index].get_payload(split, json);
+        by_start.push_back(std::make_pair(now, fd));
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    };
+
+    auto handle_events = [&](Request& req, uint32_t events)
+    {
+        if (!req.connected && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+        {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(req.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err)
+            {
+                finish(req, "connect");
+                return;
+            }
+            req.connected = true;
+        }
+        if (!req.connected)
+            return;
+        while (req.sent < req.payload.length())
+        {
+            ssize_t n = send(req.fd, req.payload.data() + req.sent, req.payload.length() - req.sent, MSG_NOSIGNAL);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return;
+                finish(req, "send");
+                return;
+            }
+            req.sent += n;
+            stats.bytes_sent += n;
+        }
+        char buf[65536];
+        while (true)
+        {
+            ssize_t n = recv(req.fd, buf, sizeof(buf), 0);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return;
+                finish(req, req.inbuf.empty() ? "reset" : "short_reply");
+                return;
+            }
+            if (n == 0)
+                break;
+            req.inbuf.append(buf, n);
+            stats.bytes_received += n;
+        }
+        // The server closes the connection once the whole reply is written.
+        finish(req, check_reply(req.inbuf, players[req.player]));
+    };
+
+    uint64_t start_ns = get_time_ns();
+    uint64_t end_ns = start_ns + uint64_t(duration * 1e9);
+    uint64_t interval_ns = uint64_t(1e9 / rate);
+    uint64_t timeout_ns = uint64_t(timeout_ms) * 1000000;
+    uint64_t next_send_ns = start_ns;
+    uint64_t next_report_ns = start_ns + 1000000000;
+    uint64_t last_completed = 0;
+
+    while (true)
+    {
+        uint64_t now = get_time_ns();
+        while (next_send_ns <= now && next_send_ns < end_ns)
+        {
+            if (inflight.size() < max_inflight)
+                start_request(now);
+            else
+                stats.skipped++;
+            next_send_ns += interval_ns;
+        }
+        if (next_send_ns >= end_ns && inflight.empty())
+            break;
+
+        int wait_ms = 10;
+        if (next_send_ns < end_ns)
+            wait_ms = std::min<uint64_t>(wait_ms, (next_send_ns - std::min(next_send_ns, now)) / 1000000);
+        int event_count = epoll_wait(epoll_fd, events, max_events, wait_ms);
+        for (int i = 0; i < event_count; i++)
+        {
+            auto it = inflight.find(events[i].data.fd);
+            if (it != inflight.end())
+                handle_events(it->second, events[i].events);
+        }
+
+        now = get_time_ns();
+        while (!by_start.empty())
+        {
+            auto [started, fd] = by_start.front();
+            auto it = inflight.find(fd);
+            if (it == inflight.end() || it->second.start_ns != started)
+            {
+                by_start.pop_front();
+                continue;
+            }
+            if (now - started < timeout_ns)
+                break;
+            by_start.pop_front();
+            finish(it->second, "timeout");
+        }
+
+        if (now >= next_report_ns)
+        {
+            fprintf(stderr, "%3us  %lu done/s  %zu in flight  %lu errors  %lu skipped\n", unsigned((now - start_ns) / 1000000000),
+                    (unsigned long)(stats.completed - last_completed), inflight.size(), (unsigned long)stats.error_count(), (unsigned long)stats.skipped);
+            last_completed = stats.completed;
+            next_report_ns += 1000000000;
+        }
+    }
+    uint64_t elapsed_ns = get_time_ns() - start_ns;
+    close(epoll_fd);
+
+    std::vector<uint64_t>& sorted = stats.latencies_ns;
+    std::sort(sorted.begin(), sorted.end());
+    uint64_t total_ns = 0;
+    for (uint64_t ns : sorted)
+        total_ns += ns;
+
+    SaveObjectMap* omap = new SaveObjectMap;
+    SaveObjectMap* config = new SaveObjectMap;
+    config->add_string("host", host);
+    config->add_num("port", port);
+    config->add_num("players", player_count);
+    config->add_num("friends", friend_count);
+    config->add_num("rate", rate);
+    config->add_num("duration_ms", duration * 1000);
+    config->add_num("max_inflight", max_inflight);
+    config->add_num("timeout_ms", timeout_ms);
+    config->add_num("split", split);
+    config->add_num("json", json);
+    omap->add_item("config", config);
+    omap->add_num("elapsed_ms", elapsed_ns / 1000000);
+    omap->add_num("started", stats.started);
+    omap->add_num("completed", stats.completed);
+    omap->add_num("skipped", stats.skipped);
+    omap->add_num("completed_per_sec", elapsed_ns ? stats.completed * 1000000000 / elapsed_ns : 0);
+    omap->add_num("bytes_sent", stats.bytes_sent);
+    omap->add_num("bytes_received", stats.bytes_received);
+    SaveObjectMap* error_map = new SaveObjectMap;
+    for (auto& [name, count] : stats.errors)
+        error_map->add_num(name, count);
+    omap->add_item("errors", error_map);
+    SaveObjectMap* latency = new SaveObjectMap;
+    latency->add_num("mean_us", sorted.empty() ? 0 : total_ns / sorted.size() / 1000);
+    latency->add_num("p50_us", percentile(sorted, 0.5) / 1000);
+    latency->add_num("p90_us", percentile(sorted, 0.9) / 1000);
+    latency->add_num("p99_us", percentile(sorted, 0.99) / 1000);
+    latency->add_num("p999_us", percentile(sorted, 0.999) / 1000);
+    latency->add_num("max_us", sorted.empty() ? 0 : sorted.back() / 1000);
+    omap->add_item("latency", latency);
+
+    if (out_filename)
+    {
+        std::ofstream outfile(out_filename);
+        omap->pretty_print(outfile);
+        outfile << "\n";
+    }
+    else
+    {
+        omap->pretty_print(std::cout);
+        std::cout << "\n";
+    }
+    delete omap;
+    return stats.error_count() ? 2 : 0;
+}
@@ -1,24 +1,43 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <string>
 #include <iostream>
 #include <string>
 #include <sstream>
 #include <fstream>
 #include <list>
+#include <deque>
 #include <stdexcept>
 #include <signal.h>
 #include <codecvt>
 #include <locale>
 #include <time.h>
 #include <set>
+#include <algorithm>
 #include <curl/curl.h>
+#include <ext/pb_ds/assoc_container.hpp>
+#include <ext/pb_ds/tree_policy.hpp>
 
 #include <unistd.h>
+#include <errno.h>
+#include <unordered_map>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/eventfd.h>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <atomic>
+#include <filesystem>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include "BombeServer.h"
 #include "Compress.h"
 #include "SaveState.h"
 
@@ -28,54 +47,131 @@ const int GAME_MODE_TYPES = 5;
 
 typedef int64_t Score;
 
+// Replies go out in the encoding the request came in. Clients from before
+// the binary encoding send and can only read JSON.
+static std::string compress_reply(SaveObject* sob, bool binary)
+{
+    return compress_string(binary ? sob->to_binary() : sob->to_string(), COMPRESS_NETWORK);
+}
+
+// Builds and reads the compact db.save snapshot: unsigned varints, strings
+// as a varint length and the bytes, and fixed width u64s where the values
+// are hashes. See Database::snapshot for the layout.
+// Varints staged in out and handed on to sink as it fills.
+class SnapshotWriter
+{
+public:
+    std::string out;
+    std::ostream& sink;
+
+    SnapshotWriter(std::ostream& sink_) : sink(sink_) {}
+    void flush()
+    {
+        sink.write(out.data(), out.size());
+        out.clear();
+    }
+    void put(uint64_t v)
+    {
+        if (out.size() >= (1 << 16))
+            flush();
+        while (v >= 0x80)
+        {
+            out.push_back(char(v | 0x80));
+            v >>= 7;
+        }
+        out.push_back(char(v));
+    }
+    void put_string(const std::string& str)
+    {
+        put(str.size());
+        out.append(str);
+    }
+    void put_u64(uint64_t v)
+    {
+        out.append((char*)&v, 8);
+    }
+};
+
+class SnapshotReader
+{
+public:
+    SnapshotReader(const std::string& in_) : in(in_) {}
+
+    uint64_t get()
+    {
+        uint64_t v = 0;
+        for (int shift = 0; shift < 64; shift += 7)
+        {
+            if (pos >= in.size())
+                throw(std::runtime_error("Truncated snapshot"));
+            uint8_t b = in[pos++];
+            v |= uint64_t(b & 0x7F) << shift;
+            if (!(b & 0x80))
+                return v;
+        }
+        throw(std::runtime_error("Bad varint in snapshot"));
+    }
+    std::string get_string()
+    {
+        uint64_t len = get();
+        if (len > in.size() - pos)
+            throw(std::runtime_error("Truncated snapshot"));
+        std::string str = in.substr(pos, len);
+        pos += len;
+        return str;
+    }
+    uint64_t get_u64()
+    {
+        if (in.size() - pos < 8)
+            throw(std::runtime_error("Truncated snapshot"));
+        uint64_t v;
+        memcpy(&v, in.data() + pos, 8);
+        pos += 8;
+        return v;
+    }
+    // Bound a count read from the file by the bytes left, so a corrupt count
+    // cannot cause a huge allocation.
+    uint64_t get_count()
+    {
+        uint64_t count = get();
+        if (count > in.size() - pos)
+            throw(std::runtime_error("Bad count in snapshot"));
+        return count;
+    }
+    void skip(size_t len)
+    {
+        if (len > in.size() - pos)
+            throw(std::runtime_error("Truncated snapshot"));
+        pos += len;
+    }
+
+private:
+    const std::string& in;
+    size_t pos = 0;
+};
+
 struct LevelStats
 {
     uint32_t completed = 0;
     uint32_t total = 0;
 };
 
+// Scores are kept in an order statistic tree keyed by (-score, id), so the
+// best score comes first and a player's rank is found in O(log n). Equal
+// scores are ordered by id. user_score maps each id to its current key.
+typedef __gnu_pbds::tree<std::pair<Score, uint64_t>, __gnu_pbds::null_type, std::less<std::pair<Score, uint64_t>>,
+                         __gnu_pbds::rb_tree_tag, __gnu_pbds::tree_order_statistics_node_update> ScoreTree;
+
 class ScoreTable
 {
 public:
-    std::multimap<Score, uint64_t> sorted_scores;
-    std::map<uint64_t, Score> user_score;
+    ScoreTree sorted_scores;
+    std::unordered_map<uint64_t, Score> user_score;
     LevelStats stats[30][200];
     
     ~ScoreTable()
     {
    
-    }
-    SaveObject* save()
-    {
-        SaveObjectMap* obj = new SaveObjectMap;
-        SaveObjectList* score_list = new SaveObjectList;
-        for(auto const &score : sorted_scores)
-        {
-            SaveObjectMap* score_map = new SaveObjectMap;
-            score_map->add_num("id", score.second);
-            score_map->add_num("score", user_score[score.second]);
-            score_list->add_item(score_map);
-        }
-        obj->add_item("scores", score_list);
-
-        SaveObjectList* stats_list = new SaveObjectList;
-        for (int i=0; i<30; i++)
-        {
-            SaveObjectList* sub_stats_list = new SaveObjectList;
-            for (int j = 0; j < 200; j++)
-            {
-                SaveObjectList* stat = new SaveObjectList;
-                SaveObjectNumber* comp = new SaveObjectNumber(stats[i][j].completed);
-                SaveObjectNumber* total = new SaveObjectNumber(stats[i][j].total);
-                stat->add_item(comp);
-                stat->add_item(total);
-                sub_stats_list->add_item(stat);
-            }
-            stats_list->add_item(sub_stats_list);
-        }
-        obj->add_item("stats", stats_list);
-
-        return obj;
     }
     void load(SaveObject* sobj)
     {
@@ -103,6 +199,50 @@ public:
         }
     }
 
+    // The best score, then every score best first as the drop from the one
+    // before, so most take a single byte; then the stats grid as two columns.
+    void save_snapshot(SnapshotWriter& w)
+    {
+        w.put(sorted_scores.size());
+        Score prev = sorted_scores.empty() ? 0 : -sorted_scores.begin()->first;
+        w.put(prev);
+        for (auto const &score : sorted_scores)
+        {
+            w.put(prev + score.first);
+            w.put(score.second);
+            prev = -score.first;
+        }
+        for (int i = 0; i < 30; i++)
+            for (int j = 0; j < 200; j++)
+                w.put(stats[i][j].completed);
+        for (int i = 0; i < 30; i++)
+            for (int j = 0; j < 200; j++)
+                w.put(stats[i][j].total);
+    }
+
+    void load_snapshot(SnapshotReader& r)
+    {
+        uint64_t count = r.get_count();
+        user_score.reserve(user_score.size() + count);
+        Score prev = r.get();
+        for (uint64_t i = 0; i < count; i++)
+        {
+            prev -= r.get();
+            uint64_t id = r.get();
+            add_score(id, prev, true);
+        }
+        for (int i = 0; i < 30; i++)
+            for (int j = 0; j < 200; j++)
+                stats[i][j].completed = r.get();
+        for (int i = 0; i < 30; i++)
+            for (int j = 0; j < 200; j++)
+            {
+                stats[i][j].total = r.get();
+                if (stats[i][j].completed < 120)
+                    stats[i][j].completed = 0;
+            }
+    }
+
     void add_score(uint64_t steam_id, Score score, bool force = false)
     {
         if (!force && (user_score.count(steam_id)) && (score <= user_score[steam_id]))
@@ -110,19 +250,27 @@ public:
         if (!steam_id)
             return;
 
-        for (auto it = sorted_scores.begin(); it != sorted_scores.end(); )
+        auto it = user_score.find(steam_id);
+        if (it != user_score.end())
         {
-           if (it->second == steam_id)
-                it = sorted_scores.erase(it);
-           else
-               ++it;
+            sorted_scores.erase(std::make_pair(-it->second, steam_id));
+            user_score.erase(it);
         }
-        user_score.erase(steam_id);
         if (!score)
             return;
         sorted_scores.insert({-score, steam_id});
         user_score[steam_id] = score;
-    } 
+    }
+
+    // 1 based position of the player, or 0 if they have no score.
+    unsigned rank(uint64_t steam_id)
+    {
+        auto it = user_score.find(steam_id);
+        if (it == user_score.end())
+            return 0;
+        return sorted_scores.order_of_key(std::make_pair(-it->second, steam_id)) + 1;
+    }
+
     void reset()
     {
         sorted_scores.clear();
@@ -152,7 +300,6 @@ static const char* neg_server_level_types[] = { "A6500000700000030", "B550000070
                                                 "A6500000000070030", "B5500000000070030","C8500000000070030","A8710000000070030", "B7710000000070030",
                                                 "A6500000000007030", "B5500000000007030","C8500000000007030","A8710000000007030", "B7710000000007030",
                                             NULL};
-static const int game_version = 14;
 
 class Player
 {
@@ -166,26 +313,242 @@ public:
     {}
 };
 
+// Steam ids of verified session tickets. Tickets are stored as a 64 bit
+// hash and expire ttl seconds after they were verified, after which the
+// client is checked with Steam again. The oldest entries are dropped once
+// there are more than capacity. Entries are saved with the database so a
+// restart does not re-verify every client.
+class SessionCache
+{
+public:
+    class Entry
+    {
+    public:
+        uint64_t steam_id = 0;
+        time_t expires = 0;
+    };
+
+    time_t ttl = 60 * 60 * 24;
+    size_t capacity = 1 << 20;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+
+    static uint64_t hash(const std::string& ticket)
+    {
+        uint64_t hash = 0xCBF29CE484222325ULL;
+        for (char c : ticket)
+        {
+            hash ^= uint8_t(c);
+            hash *= 0x100000001B3ULL;
+        }
+        return hash;
+    }
+
+    bool find(const std::string& ticket, uint64_t& steam_id)
+    {
+        auto it = entries.find(hash(ticket));
+        if (it == entries.end() || it->second.expires <= time(NULL))
+            return false;
+        steam_id = it->second.steam_id;
+        return true;
+    }
+
+    // As find, but counted in the hit and miss stats.
+    bool lookup(const std::string& ticket, uint64_t& steam_id)
+    {
+        bool found = find(ticket, steam_id);
+        if (found)
+            hits++;
+        else
+            misses++;
+        return found;
+    }
+
+    void store(const std::string& ticket, uint64_t steam_id)
+    {
+        insert(hash(ticket), steam_id, time(NULL) + ttl);
+    }
+
+    size_t size()
+    {
+        return entries.size();
+    }
+
+    void load(SaveObject* sobj)
+    {
+        SaveObjectList* session_list = sobj->get_list();
+        time_t now = time(NULL);
+        for (unsigned i = 0; i < session_list->get_count(); i++)
+        {
+            SaveObjectMap* omap = session_list->get_item(i)->get_map();
+            time_t expires = omap->get_num("expires");
+            if (expires > now)
+                insert(omap->get_num("key"), omap->get_num("id"), expires);
+        }
+    }
+
+    void save_snapshot(SnapshotWriter& w)
+    {
+        expire(time(NULL));
+        auto live = [&](time_t expires, uint64_t key)
+        {
+            auto it = entries.find(key);
+            return (it != entries.end() && it->second.expires == expires) ? &it->second : NULL;
+        };
+        uint64_t count = 0;
+        for (auto [expires, key] : order)
+            count += live(expires, key) != NULL;
+        w.put(count);
+        for (auto [expires, key] : order)
+        {
+            Entry* entry = live(expires, key);
+            if (!entry)
+                continue;
+            w.put_u64(key);
+            w.put(entry->steam_id);
+            w.put(expires);
+        }
+    }
+
+    void load_snapshot(SnapshotReader& r)
+    {
+        uint64_t count = r.get_count();
+        time_t now = time(NULL);
+        for (uint64_t i = 0; i < count; i++)
+        {
+            uint64_t key = r.get_u64();
+            uint64_t steam_id = r.get();
+            time_t expires = r.get();
+            if (expires > now)
+                insert(key, steam_id, expires);
+        }
+    }
+
+private:
+    void insert(uint64_t key, uint64_t steam_id, time_t expires)
+    {
+        Entry& entry = entries[key];
+        entry.steam_id = steam_id;
+        entry.expires = expires;
+        order.push_back(std::make_pair(expires, key));
+        expire(time(NULL));
+    }
+
+    // order holds one record per insert, oldest first; records for keys
+    // that have since been stored again are skipped.
+    void expire(time_t now)
+    {
+        while (!order.empty())
+        {
+            auto [expires, key] = order.front();
+            auto it = entries.find(key);
+            if (it == entries.end() || it->second.expires != expires)
+            {
+                order.pop_front();
+                continue;
+            }
+            if (expires > now && entries.size() <= capacity)
+                break;
+            entries.erase(it);
+            order.pop_front();
+        }
+    }
+
+    std::unordered_map<uint64_t, Entry> entries;
+    std::deque<std::pair<time_t, uint64_t>> order;
+};
 
+// Requests are handled on worker threads. The score tables of each game
+// mode have their own lock, taken shared to build replies and exclusively
+// to record scores, so requests for different modes never wait on each
+// other. players, the server level lists and the steam sessions have a lock
+// each. Locks are taken in the order mode, players, levels, sessions; the
+// shared score caches are locked before the mode they belong to.
 class Database
 {
 public:
+    std::shared_mutex mode_mutex[GAME_MODE_TYPES];
+    std::shared_mutex players_mutex;
+    std::mutex levels_mutex;
+    std::mutex sessions_mutex;
+
     std::map<uint64_t, Player> players;
     ScoreTable scores[GAME_MODE_TYPES][LEVEL_TYPES];
-    std::map<std::string, uint64_t> steam_sessions;
+    SessionCache steam_sessions;
     std::vector<std::vector<std::string>> server_levels;
     std::vector<std::vector<std::string>> next_server_levels;
     std::vector<std::vector<std::string>> neg_server_levels;
     std::vector<std::vector<std::string>> next_neg_server_levels;
     int server_levels_version = 0;
+    uint64_t wal_generation = 0;
 
+    class SharedScores
+    {
+    public:
+        std::mutex mutex;
+        std::string comp;
+        std::string comp_json;
+        std::atomic<bool> dirty{true};
+        std::atomic<bool> expired{false};
+        time_t built = 0;
+    };
+    SharedScores shared_scores[GAME_MODE_TYPES];
+    time_t shared_scores_max_age = 5;
+    std::string server_levels_comp;
+    std::string server_levels_comp_json;
+    int server_levels_comp_version = -1;
 
 
     void update_name(uint64_t steam_id, std::string& steam_username)
     {
+        std::unique_lock<std::shared_mutex> lock(players_mutex);
         players[steam_id].name = steam_username;
     }
 
+    // Hold every lock, e.g. for the weekly rollover or while forking the
+    // snapshot writer, so nothing is seen half updated.
+    void lock_all()
+    {
+        for (std::shared_mutex& mutex : mode_mutex)
+            mutex.lock();
+        players_mutex.lock();
+        levels_mutex.lock();
+        sessions_mutex.lock();
+    }
+
+    void unlock_all()
+    {
+        sessions_mutex.unlock();
+        levels_mutex.unlock();
+        players_mutex.unlock();
+        for (std::shared_mutex& mutex : mode_mutex)
+            mutex.unlock();
+    }
+
+    bool lookup_session(const std::string& ticket, uint64_t& steam_id)
+    {
+        std::lock_guard<std::mutex> guard(sessions_mutex);
+        return steam_sessions.lookup(ticket, steam_id);
+    }
+
+    bool find_session(const std::string& ticket, uint64_t& steam_id)
+    {
+        std::lock_guard<std::mutex> guard(sessions_mutex);
+        return steam_sessions.find(ticket, steam_id);
+    }
+
+    void store_session(const std::string& ticket, uint64_t steam_id)
+    {
+        std::lock_guard<std::mutex> guard(sessions_mutex);
+        steam_sessions.store(ticket, steam_id);
+    }
+
+    int get_server_levels_version()
+    {
+        std::lock_guard<std::mutex> guard(levels_mutex);
+        return server_levels_version;
+    }
+
     void load(SaveObject* sobj)
     {
         SaveObjectMap* omap = sobj->get_map();
@@ -253,6 +616,10 @@ public:
         }
 
         server_levels_version = omap->get_num("server_levels_version");
+        if (omap->has_key("steam_sessions"))
+            steam_sessions.load(omap->get_item("steam_sessions"));
+        if (omap->has_key("wal_generation"))
+            wal_generation = omap->get_num("wal_generation");
 
         if (omap->has_key("neg_server_levels"))
         {
@@ -286,96 +653,190 @@ public:
 
     }
 
-    SaveObject* save(bool lite)
+    // The db.save layout, before compression: "BDBS", the snapshot version,
+    // then game_version, server_levels_version and wal_generation; players
+    // in id order as the gap from the previous id, name and weekly scores;
+    // every score table; the four server level lists; the steam sessions.
+    static const int snapshot_version = 1;
+
+    static bool is_snapshot(const std::string& data)
     {
-        SaveObjectMap* omap = new SaveObjectMap;
-        
-        SaveObjectList* player_list = new SaveObjectList;
-        
-        for(auto &player_pair : players)
-        {
-            SaveObjectMap* player_map = new SaveObjectMap;
-            player_map->add_num("id", player_pair.first);
-            player_map->add_string("steam_username", player_pair.second.name);
-            {
-                SaveObjectList* score_list2 = new SaveObjectList;
-                for (unsigned j = 0; j < GAME_MODE_TYPES; j++)
-                {
-                    SaveObjectList* score_list = new SaveObjectList;
-                    for (unsigned i = 0; i < 10; i++)
-                        score_list->add_num(player_pair.second.weekly_scores[j][i]);
-                    score_list2->add_item(score_list);
-                }
-                player_map->add_item("scores", score_list2);
-            }
+        return data.size() >= 4 && !memcmp(data.data(), "BDBS", 4);
+    }
 
-            player_list->add_item(player_map);
+    void snapshot(std::ostream& f)
+    {
+        SnapshotWriter w(f);
+        w.out.append("BDBS");
+        w.put(snapshot_version);
+        w.put(game_version);
+        w.put(server_levels_version);
+        w.put(wal_generation);
+
+        w.put(players.size());
+        uint64_t prev_id = 0;
+        for (auto &[id, player] : players)
+        {
+            w.put(id - prev_id);
+            prev_id = id;
+            w.put_string(player.name);
+            for (unsigned j = 0; j < GAME_MODE_TYPES; j++)
+                for (unsigned i = 0; i < 10; i++)
+                    w.put(player.weekly_scores[j][i]);
         }
-        omap->add_item("players", player_list);
 
-        SaveObjectList* score_list2 = new SaveObjectList;
         for (int j = 0; j < GAME_MODE_TYPES; j++)
-        {
-            SaveObjectList* score_list = new SaveObjectList;
             for (int i = 0; i < LEVEL_TYPES; i++)
+                scores[j][i].save_snapshot(w);
+
+        for (auto* lists : {&server_levels, &next_server_levels, &neg_server_levels, &next_neg_server_levels})
+        {
+            w.put(lists->size());
+            for (std::vector<std::string>& lvl_set : *lists)
             {
-                score_list->add_item(scores[j][i].save());
+                w.put(lvl_set.size());
+                for (std::string& lvl : lvl_set)
+                    w.put_string(lvl);
             }
-            score_list2->add_item(score_list);
         }
-        omap->add_item("scores", score_list2);
-        
-        SaveObjectList* sl_list = new SaveObjectList;
-        for (std::vector<std::string>& lvl_set : server_levels)
+
+        steam_sessions.save_snapshot(w);
+        w.flush();
+    }
+
+    void load_snapshot(const std::string& data)
+    {
+        if (!is_snapshot(data))
+            throw(std::runtime_error("Not a database snapshot"));
+        SnapshotReader r(data);
+        r.skip(4);
+        if (r.get() != snapshot_version)
+            throw(std::runtime_error("Unknown database snapshot version"));
+        r.get();                        // game_version
+        server_levels_version = r.get();
+        wal_generation = r.get();
+
+        uint64_t count = r.get_count();
+        uint64_t id = 0;
+        for (uint64_t k = 0; k < count; k++)
         {
-            SaveObjectList* ssl_list = new SaveObjectList;
-            for (std::string& lvl : lvl_set)
-            {
-                ssl_list->add_string(lvl);
-            }
-            sl_list->add_item(ssl_list);
+            id += r.get();
+            Player& player = players[id];
+            player.name = r.get_string();
+            for (unsigned j = 0; j < GAME_MODE_TYPES; j++)
+                for (unsigned i = 0; i < 10; i++)
+                    player.weekly_scores[j][i] = r.get();
         }
-        omap->add_item("server_levels", sl_list);
 
-        sl_list = new SaveObjectList;
-        for (std::vector<std::string>& lvl_set : next_server_levels)
+        for (int j = 0; j < GAME_MODE_TYPES; j++)
+            for (int i = 0; i < LEVEL_TYPES; i++)
+                scores[j][i].load_snapshot(r);
+
+        for (auto* lists : {&server_levels, &next_server_levels, &neg_server_levels, &next_neg_server_levels})
         {
-            SaveObjectList* ssl_list = new SaveObjectList;
-            for (std::string& lvl : lvl_set)
+            lists->resize(r.get_count());
+            for (std::vector<std::string>& lvl_set : *lists)
             {
-                ssl_list->add_string(lvl);
+                lvl_set.resize(r.get_count());
+                for (std::string& lvl : lvl_set)
+                    lvl = r.get_string();
             }
-            sl_list->add_item(ssl_list);
         }
-        omap->add_item("next_server_levels", sl_list);
 
-        sl_list = new SaveObjectList;
-        for (std::vector<std::string>& lvl_set : neg_server_levels)
+        steam_sessions.load_snapshot(r);
+    }
+
+    // Record a scores request from steam_id: their name, completion stats,
+    // best scores and any level they generated. Also used to replay the
+    // write ahead log. Returns the score counted for each level type. The
+    // caller holds mode_mutex[mode] exclusively.
+    std::vector<unsigned> apply_scores(SaveObjectMap* omap, uint64_t steam_id, int mode)
+    {
+        std::vector<unsigned> counted;
+        std::string steam_username;
+        omap->get_string("steam_username", steam_username);
+        update_name(steam_id, steam_username);
+        int levels_version = get_server_levels_version();
+
+        SaveObjectList* progress_list = omap->get_item("level_progress")->get_list();
+        for (unsigned lset = 0; lset < progress_list->get_count() && lset < LEVEL_TYPES - 1; lset++)
         {
-            SaveObjectList* ssl_list = new SaveObjectList;
-            for (std::string& lvl : lvl_set)
+            if (steam_id == SECRET_ID)
+                continue;
+            if (steam_id == 0ull)
+                continue;
+            if (omap->has_key("server_levels_version") && (omap->get_num("server_levels_version") != levels_version))
+                continue;
+
+
+            unsigned score = 0;
+            SaveObjectList* l = progress_list->get_item(lset)->get_list();
+            for (unsigned lgrp = 0; lgrp < l->get_count() && lgrp < 30; lgrp++)
             {
-                ssl_list->add_string(lvl);
+                std::string s = l->get_item(lgrp)->get_string();
+                for (unsigned i = 0; i < s.length() && i < 200; i++)
+                {
+                    bool c = (s[i] == '1');
+                    scores[mode][lset].stats[lgrp][i].total++;
+                    if (c)
+                    {
+                        scores[mode][lset].stats[lgrp][i].completed++;
+                        score++;
+                    }
+                }
             }
-            sl_list->add_item(ssl_list);
+            scores[mode][lset].add_score(steam_id, score);
+            counted.push_back(score);
+        }
+        if(omap->has_key("level_gen_req") && omap->has_key("level_gen_resp"))
+        {
+            std::string req = omap->get_string("level_gen_req");
+            std::string resp = omap->get_string("level_gen_resp");
+            std::lock_guard<std::mutex> guard(levels_mutex);
+            add_server_level(req, resp);
         }
-        omap->add_item("neg_server_levels", sl_list);
+        scores_changed(mode);
+        return counted;
+    }
 
-        sl_list = new SaveObjectList;
-        for (std::vector<std::string>& lvl_set : next_neg_server_levels)
+    // Move to next week's server levels and fold this week's scores into
+    // the weekly tables. The caller holds every lock.
+    void weekly_rollover()
+    {
+        server_levels = next_server_levels;
+        next_server_levels.clear();
+        neg_server_levels = next_neg_server_levels;
+        next_neg_server_levels.clear();
+        server_levels_version++;
+
+        int windex = server_levels_version % 10;
+        for (int i = 0; i < GAME_MODE_TYPES; i++)
         {
-            SaveObjectList* ssl_list = new SaveObjectList;
-            for (std::string& lvl : lvl_set)
+            scores[i][LEVEL_TYPES - 1].reset();
+            for(auto& [id, val] : players)
             {
-                ssl_list->add_string(lvl);
+                uint64_t score = 0;
+                if (scores[i][LEVEL_TYPES-2].user_score.count(id))
+                    score = scores[i][LEVEL_TYPES-2].user_score[id];
+                val.weekly_scores[i][windex] = score;
+
+                score = 0;
+                for (int j = 1 ; j <= 10; j++)
+                {
+                    score += val.weekly_scores[i][(j + windex) % 10] * j / 10;
+                }
+                if (score)
+                    scores[i][LEVEL_TYPES - 1].add_score(id, score);
             }
-            sl_list->add_item(ssl_list);
+            scores[i][LEVEL_TYPES - 2].reset();
         }
-        omap->add_item("next_neg_server_levels", sl_list);
-        omap->add_num("server_levels_version", server_levels_version);
-        omap->add_num("game_version", game_version);
+        reset_shared_scores();
+    }
 
-        return omap;
+    void clear_next_server_levels()
+    {
+        next_server_levels.clear();
+        next_neg_server_levels.clear();
     }
 
     void add_server_level(std::string req, std::string resp)
@@ -410,45 +871,66 @@ public:
         }
     }
 
-    SaveObjectMap* get_scores(int mode, uint64_t user_id, std::set<uint64_t> friends)
+    // Identifies a player's rows across lists without handing out their
+    // steam id.
+    static uint32_t row_key(uint64_t id)
     {
-        SaveObjectMap* resp = new SaveObjectMap();
+        return uint32_t((id * 0x9E3779B97F4A7C15ULL) >> 32);
+    }
+
+    // Rows for each level type: the top rows followed by the player and
+    // their friends, flagged 2 and 1 respectively. The caller holds
+    // mode_mutex[mode].
+    SaveObjectList* get_score_rows(int mode, uint64_t user_id, const std::set<uint64_t>& friends, unsigned top)
+    {
+        std::shared_lock<std::shared_mutex> lock(players_mutex);
         SaveObjectList* top_list = new SaveObjectList();
         for (int i = 0; i < LEVEL_TYPES; i++)
         {
+            ScoreTable& table = scores[mode][i];
             SaveObjectList* score_list = new SaveObjectList();
-            int pos = 0;
-            for (std::multimap<Score, uint64_t>::iterator rit = scores[mode][i].sorted_scores.begin(); rit != scores[mode][i].sorted_scores.end(); rit++)
+            auto add_row = [&](unsigned pos, uint64_t id, int fr)
             {
-                pos++;
-                int fr = friends.count(rit->second);
-                if (rit->second == user_id)
-                    fr = 2;
-                if (pos > 100 && fr == 0)
-                    continue;
-                if (scores[mode][i].user_score[rit->second] == 0 && fr == 0)
-                    continue;
-                // if ((prevpos + 1) < pos)
-                // {
-                //     SaveObjectMap* score_map = new SaveObjectMap();
-                //     score_map->add_num("pos", 0);
-                //     score_map->add_string("name", "");
-                //     score_map->add_num("score", 0);
-                //     score_map->add_num("hidden", 1);
-                //     score_list->add_item(score_map);
-                // }
                 SaveObjectMap* score_map = new SaveObjectMap();
                 score_map->add_num("pos", pos);
-                score_map->add_string("name", players[rit->second].name);
-                score_map->add_num("score", scores[mode][i].user_score[rit->second]);
+                auto player = players.find(id);
+                score_map->add_string("name", player != players.end() ? player->second.name : "");
+                score_map->add_num("score", table.user_score.at(id));
+                score_map->add_num("key", row_key(id));
                 if (fr)
                     score_map->add_num("friend", fr);
                 score_list->add_item(score_map);
+            };
+
+            unsigned pos = 0;
+            for (auto it = table.sorted_scores.begin(); it != table.sorted_scores.end() && pos < top; it++)
+            {
+                pos++;
+                uint64_t id = it->second;
+                add_row(pos, id, (id == user_id) ? 2 : friends.count(id));
+            }
+
+            // Friends and the player themselves outside the top rows, in rank order.
+            std::vector<std::pair<unsigned, uint64_t>> others;
+            for (uint64_t id : friends)
+            {
+                unsigned r = table.rank(id);
+                if (r > top && id != user_id)
+                    others.push_back(std::make_pair(r, id));
             }
+            unsigned user_rank = table.rank(user_id);
+            if (user_rank > top)
+                others.push_back(std::make_pair(user_rank, user_id));
+            std::sort(others.begin(), others.end());
+            for (auto [r, id] : others)
+                add_row(r, id, (id == user_id) ? 2 : 1);
             top_list->add_item(score_list);
         }
-        resp->add_item("scores", top_list);
+        return top_list;
+    }
 
+    SaveObjectList* get_stats(int mode)
+    {
         SaveObjectList* top_slist = new SaveObjectList;
         for (int l = 0; l < LEVEL_TYPES - 1; l++)
         {
@@ -468,8 +950,12 @@ public:
             }
             top_slist->add_item(stats_list);
         }
-        resp->add_item("stats", top_slist);
-        
+        return top_slist;
+    }
+
+    void add_level_gen_req(SaveObjectMap* resp)
+    {
+        std::lock_guard<std::mutex> guard(levels_mutex);
         bool got_lev_req = false;
         for (unsigned i = 0;  server_level_types[i]; i++)
         {
@@ -493,75 +979,989 @@ public:
                     break;
                 }
             }
+    }
+
+    SaveObjectMap* get_scores(int mode, uint64_t user_id, const std::set<uint64_t>& friends)
+    {
+        std::shared_lock<std::shared_mutex> lock(mode_mutex[mode]);
+        SaveObjectMap* resp = new SaveObjectMap();
+        resp->add_item("scores", get_score_rows(mode, user_id, friends, 100));
+        resp->add_item("stats", get_stats(mode));
+        add_level_gen_req(resp);
         resp->add_num("game_mode", mode);
         return resp;
     }
 
-};
-
-static size_t curl_write_data(void *ptr, size_t size, size_t nmemb, void *usr)
-{
-    size *= nmemb;
-    std::string& s = *((std::string*) usr);
-    s.append((char*)ptr, size);
-    return size;
-}
-
-class Connection
-{
-public:
-    struct sockaddr_in clientaddr;
-    int conn_fd;
-    int length;
-    std::string inbuf;
-    std::string outbuf;
-    Connection(int conn_fd_):
-        conn_fd(conn_fd_),
-        length(-1)
+    // The part of a split response that differs between players. It is
+    // followed on the wire by get_shared_scores().
+    SaveObjectMap* get_user_scores(int mode, uint64_t user_id, const std::set<uint64_t>& friends)
     {
+        std::shared_lock<std::shared_mutex> lock(mode_mutex[mode]);
+        SaveObjectMap* resp = new SaveObjectMap();
+        resp->add_item("friend_scores", get_score_rows(mode, user_id, friends, 0));
+        add_level_gen_req(resp);
+        resp->add_num("game_mode", mode);
+        resp->add_num("shared", 1);
+        return resp;
     }
 
-    void recieve(Database& db)
+    // Compressed top 100 lists and completion stats for a game mode. These
+    // are the bulk of every scores response and are the same for everyone,
+    // so they are only rebuilt once they have changed and are at least
+    // shared_scores_max_age seconds old. Threads asking while it is rebuilt
+    // wait for the new copy rather than building their own. A binary and a
+    // JSON copy are built together.
+    std::string get_shared_scores(int mode, bool binary)
     {
-        static char buf[1024];
-        while (true)
+        SharedScores& shared = shared_scores[mode];
+        std::lock_guard<std::mutex> guard(shared.mutex);
+        time_t now = time(NULL);
+        if (shared.comp.empty() || shared.expired || (shared.dirty && now - shared.built >= shared_scores_max_age))
         {
-            ssize_t num_bytes_received = recv(conn_fd, buf, sizeof(buf), MSG_DONTWAIT);
-            if (num_bytes_received  == -1)
-            {
-                if (errno != EAGAIN && errno != EWOULDBLOCK)
-                    close();
-                break;
+            std::shared_lock<std::shared_mutex> lock(mode_mutex[mode]);
+            shared.expired = false;
+            SaveObjectMap* resp = new SaveObjectMap();
+            resp->add_item("scores", get_score_rows(mode, 0, std::set<uint64_t>(), 100));
+            resp->add_item("stats", get_stats(mode));
+            shared.comp = compress_reply(resp, true);
+            shared.comp_json = compress_reply(resp, false);
+            delete resp;
+            shared.dirty = false;
+            shared.built = now;
+        }
+        return binary ? shared.comp : shared.comp_json;
+    }
+
+    void add_server_levels(SaveObjectMap* resp)
+    {
+        resp->add_num("server_levels_version", server_levels_version);
+        SaveObjectList* sl_list = new SaveObjectList;
+        for (std::vector<std::string>& lvl_set : server_levels)
+        {
+            SaveObjectList* ssl_list = new SaveObjectList;
+            for (std::string& lvl : lvl_set)
+            {
+                ssl_list->add_string(lvl);
             }
-            else if (num_bytes_received  == 0)
+            sl_list->add_item(ssl_list);
+        }
+        resp->add_item("server_levels", sl_list);
+        if (neg_server_levels.size())
+        {
+            sl_list = new SaveObjectList;
+            for (std::vector<std::string>& lvl_set : neg_server_levels)
             {
-                close();
+                SaveObjectList* ssl_list = new SaveObjectList;
+                for (std::string& lvl : lvl_set)
+                {
+                    ssl_list->add_string(lvl);
+                }
+                sl_list->add_item(ssl_list);
+            }
+            resp->add_item("neg_server_levels", sl_list);
+        }
+    }
+
+    // The compressed level pool sent to clients whose server_levels_version
+    // is out of date. The pool only changes along with the version.
+    std::string get_server_levels(bool binary)
+    {
+        std::lock_guard<std::mutex> guard(levels_mutex);
+        if (server_levels_comp_version != server_levels_version || server_levels_comp.empty())
+        {
+            SaveObjectMap* resp = new SaveObjectMap();
+            add_server_levels(resp);
+            server_levels_comp = compress_reply(resp, true);
+            server_levels_comp_json = compress_reply(resp, false);
+            server_levels_comp_version = server_levels_version;
+            delete resp;
+        }
+        return binary ? server_levels_comp : server_levels_comp_json;
+    }
+
+    void scores_changed(int mode)
+    {
+        shared_scores[mode].dirty = true;
+    }
+
+    // Rebuild on the next request regardless of age, e.g. after the weekly
+    // reset.
+    void reset_shared_scores()
+    {
+        for (SharedScores& shared : shared_scores)
+            shared.expired = true;
+    }
+
+};
+
+static size_t curl_write_data(void *ptr, size_t size, size_t nmemb, void *usr)
+{
+    size *= nmemb;
+    std::string& s = *((std::string*) usr);
+    s.append((char*)ptr, size);
+    return size;
+}
+
+// Verifies Steam session tickets without blocking the event loop. Transfers
+// run on a curl multi handle whose sockets are registered with the server's
+// epoll instance; connections waiting on the same ticket share one transfer.
+// Finished transfers are collected with take_results().
+class SteamAuth
+{
+public:
+    class Result
+    {
+    public:
+        std::string ticket;
+        std::string response;
+        bool ok = false;
+        std::vector<int> waiters;
+    };
+
+    std::string endpoint = "https://partner.steam-api.com/ISteamUserAuth/AuthenticateUserTicket/v1/";
+
+    void init(int epoll_fd_)
+    {
+        epoll_fd = epoll_fd_;
+        multi = curl_multi_init();
+        curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, socket_callback);
+        curl_multi_setopt(multi, CURLMOPT_SOCKETDATA, this);
+        curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, timer_callback);
+        curl_multi_setopt(multi, CURLMOPT_TIMERDATA, this);
+    }
+
+    void cleanup()
+    {
+        for (auto& [ticket, result] : transfers)
+        {
+            curl_multi_remove_handle(multi, result.first);
+            curl_easy_cleanup(result.first);
+            delete result.second;
+        }
+        transfers.clear();
+        curl_multi_cleanup(multi);
+        multi = NULL;
+    }
+
+    // Queue a check of ticket for the connection conn_fd. Returns false if
+    // the transfer could not be created.
+    bool start(const std::string& ticket, const char* appid, int conn_fd)
+    {
+        auto it = transfers.find(ticket);
+        if (it != transfers.end())
+        {
+            it->second.second->waiters.push_back(conn_fd);
+            return true;
+        }
+        CURL* curl = curl_easy_init();
+        if (!curl)
+            return false;
+        Result* result = new Result;
+        result->ticket = ticket;
+        result->waiters.push_back(conn_fd);
+
+        std::string url = endpoint + "?key=44D5549D3DC57BCF2492489740F0354A&appid=" + appid + "&ticket=" + ticket;
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+//        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
+//        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10L);
+        curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_data);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &result->response);
+        curl_easy_setopt(curl, CURLOPT_PRIVATE, result);
+        curl_multi_add_handle(multi, curl);
+        transfers[ticket] = std::make_pair(curl, result);
+        return true;
+    }
+
+    bool owns(int fd)
+    {
+        return sockets.count(fd);
+    }
+
+    void socket_ready(int fd, uint32_t events)
+    {
+        int flags = 0;
+        if (events & EPOLLIN)
+            flags |= CURL_CSELECT_IN;
+        if (events & EPOLLOUT)
+            flags |= CURL_CSELECT_OUT;
+        if (events & (EPOLLERR | EPOLLHUP))
+            flags |= CURL_CSELECT_ERR;
+        int running;
+        curl_multi_socket_action(multi, fd, flags, &running);
+    }
+
+    // Milliseconds until curl next needs servicing, at most max_ms.
+    int wait_ms(int max_ms)
+    {
+        if (deadline < 0)
+            return max_ms;
+        int64_t left = deadline - now_ms();
+        return left < 0 ? 0 : left > max_ms ? max_ms : int(left);
+    }
+
+    void check_timeout()
+    {
+        if (deadline < 0 || now_ms() < deadline)
+            return;
+        deadline = -1;
+        int running;
+        curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0, &running);
+    }
+
+    std::vector<Result*> take_results()
+    {
+        std::vector<Result*> results;
+        CURLMsg* msg;
+        int queued;
+        while ((msg = curl_multi_info_read(multi, &queued)))
+        {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+            CURL* curl = msg->easy_handle;
+            Result* result;
+            curl_easy_getinfo(curl, CURLINFO_PRIVATE, &result);
+            result->ok = (msg->data.result == CURLE_OK);
+            if (!result->ok)
+                printf("curl transfer failed: %s\n", curl_easy_strerror(msg->data.result));
+            curl_multi_remove_handle(multi, curl);
+            curl_easy_cleanup(curl);
+            transfers.erase(result->ticket);
+            results.push_back(result);
+        }
+        return results;
+    }
+
+private:
+    static int64_t now_ms()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return int64_t(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    static int socket_callback(CURL* curl, curl_socket_t fd, int what, void* usr, void* socketp)
+    {
+        SteamAuth* auth = (SteamAuth*) usr;
+        if (what == CURL_POLL_REMOVE)
+        {
+            epoll_ctl(auth->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            auth->sockets.erase(fd);
+            return 0;
+        }
+        struct epoll_event ev = {};
+        ev.events = ((what & CURL_POLL_IN) ? EPOLLIN : 0) | ((what & CURL_POLL_OUT) ? EPOLLOUT : 0);
+        ev.data.fd = fd;
+        if (auth->sockets.insert(fd).second)
+            epoll_ctl(auth->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+        else
+            epoll_ctl(auth->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+        return 0;
+    }
+
+    static int timer_callback(CURLM* multi, long timeout_ms, void* usr)
+    {
+        SteamAuth* auth = (SteamAuth*) usr;
+        auth->deadline = (timeout_ms < 0) ? -1 : now_ms() + timeout_ms;
+        return 0;
+    }
+
+    int epoll_fd = -1;
+    CURLM* multi = NULL;
+    int64_t deadline = -1;
+    std::set<int> sockets;
+    std::map<std::string, std::pair<CURL*, Result*>> transfers;
+};
+
+static SteamAuth steam_auth;
+
+// Append only log of the changes made to the database, replayed on startup
+// to recover from a crash. Logs are named db.wal.<generation>; a snapshot
+// stores the generation of the log started right after it was taken, so
+// older logs are already included in it and are deleted once it is on
+// disk. A log starts with a magic number and its generation, followed by
+// records of a u32 payload length, a type byte and the payload. Records are
+// buffered and written once per pass of the event loop, and synced to disk
+// at most once a second. Workers append records; only the main thread
+// opens, flushes and closes the log.
+class WriteAheadLog
+{
+public:
+    enum RecordType : uint8_t
+    {
+        WAL_SCORES = 1,             // compressed scores request, as received
+        WAL_ROLLOVER = 2,
+        WAL_CLEAR_NEXT_LEVELS = 3,
+    };
+
+    static std::string filename(uint64_t generation)
+    {
+        return "db.wal." + std::to_string(generation);
+    }
+
+    // Generations of the logs on disk, oldest first.
+    static std::vector<uint64_t> list()
+    {
+        std::vector<uint64_t> generations;
+        for (const std::filesystem::directory_entry& entry : std::filesystem::directory_iterator("."))
+        {
+            std::string name = entry.path().filename().string();
+            if (name.compare(0, 7, "db.wal.") || name.length() == 7 || name.find_first_not_of("0123456789", 7) != std::string::npos)
+                continue;
+            generations.push_back(std::stoull(name.substr(7)));
+        }
+        std::sort(generations.begin(), generations.end());
+        return generations;
+    }
+
+    static void remove_before(uint64_t generation)
+    {
+        for (uint64_t old : list())
+            if (old < generation)
+                std::remove(filename(old).c_str());
+    }
+
+    void open(uint64_t generation)
+    {
+        close();
+        int new_fd = ::open(filename(generation).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+        if (new_fd < 0)
+        {
+            perror("open write ahead log");
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            fd = new_fd;
+            pending.assign("BWAL", 4);
+            pending.append((char*)&generation, 8);
+        }
+        flush(true);
+    }
+
+    void append(RecordType type, const std::string& payload = "")
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        if (fd < 0)
+            return;
+        uint32_t length = payload.length();
+        pending.append((char*)&length, 4);
+        pending.push_back(char(type));
+        pending.append(payload);
+    }
+
+    void flush(bool sync = false)
+    {
+        if (fd < 0)
+            return;
+        std::string buffer;
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            buffer.swap(pending);
+        }
+        size_t done = 0;
+        while (done < buffer.length())
+        {
+            ssize_t n = write(fd, buffer.data() + done, buffer.length() - done);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                perror("write ahead log");
                 break;
             }
-            inbuf.append(buf, num_bytes_received);
+            done += n;
+        }
+        unsynced |= !buffer.empty();
+        time_t now = time(NULL);
+        if (unsynced && (sync || now != last_sync))
+        {
+            fdatasync(fd);
+            unsynced = false;
+            last_sync = now;
+        }
+    }
+
+    void close()
+    {
+        if (fd < 0)
+            return;
+        flush(true);
+        std::lock_guard<std::mutex> guard(mutex);
+        ::close(fd);
+        fd = -1;
+    }
+
+    // Apply the records of a log to db. A torn final record, left by a
+    // crash part way through a write, is ignored.
+    static void replay(uint64_t generation, Database& db)
+    {
+        std::string name = filename(generation);
+        std::ifstream loadfile(name, std::ios::binary);
+        char magic[4];
+        uint64_t file_generation = 0;
+        loadfile.read(magic, 4);
+        loadfile.read((char*)&file_generation, 8);
+        if (!loadfile || memcmp(magic, "BWAL", 4) || file_generation != generation)
+        {
+            printf("ignoring bad log %s\n", name.c_str());
+            return;
+        }
+        unsigned count = 0;
+        while (true)
+        {
+            uint32_t length;
+            uint8_t type;
+            loadfile.read((char*)&length, 4);
+            loadfile.read((char*)&type, 1);
+            if (!loadfile)
+                break;
+            std::string payload(length, '\0');
+            loadfile.read(payload.data(), length);
+            if (!loadfile)
+                break;
+            try
+            {
+                if (type == WAL_SCORES)
+                {
+                    std::string decomp = decompress_string(payload);
+                    SaveObject* sob = SaveObject::load(decomp);
+                    SaveObjectMap* omap = sob->get_map();
+                    int mode = omap->has_key("game_mode") ? omap->get_num("game_mode") : 0;
+                    db.apply_scores(omap, omap->get_num("steam_id"), mode);
+                    delete sob;
+                }
+                else if (type == WAL_ROLLOVER)
+                    db.weekly_rollover();
+                else if (type == WAL_CLEAR_NEXT_LEVELS)
+                    db.clear_next_server_levels();
+            }
+            catch (const std::runtime_error& error)
+            {
+                std::cout << "Exception " << error.what() << "\n";
+            }
+            count++;
+        }
+        printf("replayed %u records from %s\n", count, name.c_str());
+    }
+
+private:
+    std::mutex mutex;
+    int fd = -1;
+    std::string pending;
+    bool unsynced = false;
+    time_t last_sync = 0;
+};
+
+static WriteAheadLog wal;
+
+// Write a snapshot to db.save through a temporary file so a crash never
+// leaves a partial db.save behind.
+static bool write_snapshot(Database& db)
+{
+    bool ok;
+    {
+        std::ofstream outfile("db.save.tmp", std::ios::binary);
+        CompressOStream zstream(outfile, COMPRESS_INTERACTIVE);
+        db.snapshot(zstream);
+        zstream.finish();
+        outfile.flush();
+        ok = outfile.good();
+    }
+    int fd = ::open("db.save.tmp", O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fsync(fd))
+        ok = false;
+    if (fd >= 0)
+        ::close(fd);
+    if (!ok || rename("db.save.tmp", "db.save"))
+    {
+        perror("write db.save");
+        return false;
+    }
+    fd = ::open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0)
+    {
+        fsync(fd);
+        ::close(fd);
+    }
+    return true;
+}
+
+// Snapshots are written by a forked child, which sees the database as it
+// was at the fork while the server carries on. A new log is started at the
+// same moment so no change is lost if the write fails; older logs are only
+// deleted once db.save has been safely replaced. Connections are always
+// shut down before they are closed, so the child's copies of their
+// descriptors do not hold them open. Every database lock is held across the
+// fork, so no worker is part way through an update and the child, which
+// only has the forking thread, never needs a lock.
+class Snapshotter
+{
+public:
+    // Is a snapshot still being written? Reaps the child once it is done.
+    bool busy()
+    {
+        if (pid <= 0)
+            return false;
+        int status;
+        pid_t r = waitpid(pid, &status, WNOHANG);
+        if (r == 0)
+            return true;
+        if (r == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0)
+            WriteAheadLog::remove_before(generation);
+        else
+            printf("snapshot failed\n");
+        pid = -1;
+        return false;
+    }
+
+    void start(Database& db)
+    {
+        if (busy())
+            return;
+        db.lock_all();
+        db.wal_generation++;
+        wal.open(db.wal_generation);
+        fflush(stdout);
+        pid_t child = fork();
+        if (child == 0)
+            _exit(write_snapshot(db) ? 0 : 1);
+        db.unlock_all();
+        if (child < 0)
+        {
+            perror("fork");
+            return;
+        }
+        pid = child;
+        generation = db.wal_generation;
+    }
+
+    // Write a snapshot without returning early, e.g. at startup and
+    // shutdown.
+    void save_now(Database& db)
+    {
+        join();
+        db.wal_generation++;
+        wal.open(db.wal_generation);
+        if (write_snapshot(db))
+            WriteAheadLog::remove_before(db.wal_generation);
+    }
+
+    void join()
+    {
+        while (busy())
+            usleep(10000);
+    }
+
+private:
+    pid_t pid = -1;
+    uint64_t generation = 0;
+};
+
+// A request being handled on a worker thread. The worker decodes it, checks
+// the sender's Steam session and builds the reply. A request whose ticket is
+// not yet known comes back with needs_auth set so the main thread can have
+// steam_auth check it; if the ticket is good it is queued again. conn_id
+// tells a reply for a closed connection apart from one for a new
+// connection that reuses its descriptor.
+class Job
+{
+public:
+    int conn_fd;
+    uint64_t conn_id;
+    struct sockaddr_in clientaddr;
+    std::string request;
+    SaveObjectMap* omap = NULL;
+    std::string steam_session;
+    const char* appid = NULL;
+    bool binary = false;
+    bool authed = false;
+    bool needs_auth = false;
+    bool failed = false;
+    std::string reply;
+
+    Job(int conn_fd_, uint64_t conn_id_, struct sockaddr_in& clientaddr_):
+        conn_fd(conn_fd_),
+        conn_id(conn_id_),
+        clientaddr(clientaddr_)
+    {
+    }
+    ~Job()
+    {
+        delete omap;
+    }
+
+    void run(Database& db)
+    {
+        try
+        {
+            if (!omap)
+            {
+                std::string decomp = decompress_string(request);
+                binary = SaveObject::is_binary(decomp.data(), decomp.size());
+                SaveObject* sob = SaveObject::load(decomp);
+                omap = sob->get_map();
+            }
+            uint64_t steam_id = omap->get_num("steam_id");
+            if (!authed && steam_id != SECRET_ID && steam_id != 0)
+            {
+                omap->get_string("steam_session", steam_session);
+                uint64_t session_id;
+                if (!db.lookup_session(steam_session, session_id))
+                {
+                    appid = omap->get_num("demo") ? "2263470" : omap->get_num("playtest") ? "2263480" : "2262930";
+                    needs_auth = true;
+                    return;
+                }
+            }
+            needs_auth = false;
+            handle_request(db);
+        }
+        catch (const std::exception& error)
+        {
+            std::cout << "Exception " << error.what() << "\n";
+            failed = true;
+        }
+    }
+
+    void add_reply(const std::string& comp)
+    {
+        uint32_t length = comp.length();
+        reply.append((char*)&length, 4);
+        reply.append(comp);
+    }
+
+    void handle_request(Database& db)
+    {
+        bool pirate = false;
+        uint64_t steam_id = omap->get_num("steam_id");
+        if (steam_id != SECRET_ID && steam_id != 0)
+        {
+            std::string steam_session;
+            omap->get_string("steam_session", steam_session);
+            uint64_t session_id;
+            if (db.find_session(steam_session, session_id) &&
+                (session_id != steam_id))
+            {
+                char ip4[INET_ADDRSTRLEN];
+                inet_ntop(AF_INET, &(clientaddr.sin_addr), ip4, INET_ADDRSTRLEN);
+                printf("pirate check failed %s\n", ip4);
+                pirate = true;
+                std::cout << "failed:" << steam_id << " - " << session_id << "\n";
+                // omap->save(std::cout);
+            }
+        }
+        
+        std::string command;
+        omap->get_string("command", command);
+        int player_version = omap->get_num("version");
+        if (!pirate && player_version != game_version)
+        {
+            throw(std::runtime_error("player_version != game_version"));
+            // pirate = true;
+            // printf("old version\n");
         }
+        if (pirate)
+        {
+            SaveObjectMap* scr = new SaveObjectMap();
+            scr->add_num("pirate", 1);
+            add_reply(compress_reply(scr, binary));
+            delete scr;
+        }
+        else if (command == "scores")
+        {
+            int mode = 0;
+            if (omap->has_key("game_mode"))
+                mode = omap->get_num("game_mode");
+            if (mode < 0 || mode >= GAME_MODE_TYPES)
+                throw(std::runtime_error("bad game_mode"));
+            std::string steam_username;
+            omap->get_string("steam_username", steam_username);
+            char ip4[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &(clientaddr.sin_addr), ip4, INET_ADDRSTRLEN);
+            std::string line = "scores: " + steam_username + " [" + ip4 + "] " + std::to_string(steam_id) + " (" + std::to_string(mode) + ")";
+
+            // The log record and the update are made under the same lock so
+            // the log holds each mode's updates in the order they were made.
+            {
+                std::unique_lock<std::shared_mutex> lock(db.mode_mutex[mode]);
+                wal.append(WriteAheadLog::WAL_SCORES, request);
+                for (unsigned score : db.apply_scores(omap, steam_id, mode))
+                    line += std::to_string(score) + " ";
+            }
+            printf("%s\n", line.c_str());
+            std::set<uint64_t> friends;
+            if (omap->has_key("friends"))
+            {
+                SaveObjectList* friend_list = omap->get_item("friends")->get_list();
+                for (unsigned i = 0; i < friend_list->get_count(); i++)
+                {
+                    friends.insert(friend_list->get_num(i));
+                }
+                friends.insert(omap->get_num("steam_id"));
+            }
+
+
+            // Clients that understand split responses get their own rows
+            // here, then the shared top lists and stats as a second message
+            // and, if their copy is out of date, the level pool as a third.
+            bool split = omap->has_key("shared_scores") && omap->get_num("shared_scores");
+            bool send_levels = omap->has_key("server_levels_version") && omap->get_num("server_levels_version") != db.get_server_levels_version();
+            SaveObjectMap* scr = split ? db.get_user_scores(mode, steam_id, friends) : db.get_scores(mode, steam_id, friends);
+            if (send_levels)
+            {
+                if (split)
+                    scr->add_num("levels", 1);
+                else
+                {
+                    std::lock_guard<std::mutex> guard(db.levels_mutex);
+                    db.add_server_levels(scr);
+                }
+            }
+//            scr->add_num("festivus", 1);
+
+            add_reply(compress_reply(scr, binary));
+            delete scr;
+            if (split)
+            {
+                add_reply(db.get_shared_scores(mode, binary));
+                if (send_levels)
+                    add_reply(db.get_server_levels(binary));
+            }
+        }
+        else
+        {
+            printf("unknown command: %s \n", command.c_str());
+            failed = true;
+        }
+    }
+};
+
+// Threads that run jobs. Finished jobs are collected by the main thread,
+// which is woken through event_fd.
+class WorkerPool
+{
+public:
+    int event_fd = -1;
+
+    void start(Database& db, unsigned count)
+    {
+        event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (event_fd < 0)
+            throw(std::runtime_error("eventfd failed"));
+        for (unsigned i = 0; i < count; i++)
+            threads.emplace_back(&WorkerPool::run, this, std::ref(db));
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            stopping = true;
+        }
+        cond.notify_all();
+        for (std::thread& thread : threads)
+            thread.join();
+        threads.clear();
+        for (Job* job : queue)
+            delete job;
+        queue.clear();
+        for (Job* job : take_done())
+            delete job;
+        if (event_fd >= 0)
+            ::close(event_fd);
+        event_fd = -1;
+    }
+
+    void submit(Job* job)
+    {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            queue.push_back(job);
+        }
+        cond.notify_one();
+    }
 
+    std::vector<Job*> take_done()
+    {
+        uint64_t count;
+        if (event_fd >= 0)
+            while (read(event_fd, &count, sizeof(count)) < 0 && errno == EINTR);
+        std::lock_guard<std::mutex> guard(mutex);
+        std::vector<Job*> jobs;
+        jobs.swap(done);
+        return jobs;
+    }
+
+private:
+    void run(Database& db)
+    {
         while (true)
         {
-            ssize_t num_bytes_received = send(conn_fd, outbuf.c_str(), outbuf.length(), MSG_DONTWAIT);
+            Job* job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cond.wait(lock, [this]{return stopping || !queue.empty();});
+                if (stopping)
+                    return;
+                job = queue.front();
+                queue.pop_front();
+            }
+            job->run(db);
+            bool wake;
+            {
+                std::lock_guard<std::mutex> guard(mutex);
+                wake = done.empty();
+                done.push_back(job);
+            }
+            if (wake)
+            {
+                uint64_t one = 1;
+                while (write(event_fd, &one, sizeof(one)) < 0 && errno == EINTR);
+            }
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<Job*> queue;
+    std::vector<Job*> done;
+    std::vector<std::thread> threads;
+    bool stopping = false;
+};
+
+// One client socket. A client sends a length prefixed request and the
+// connection is closed once the reply has been written. length is -1 while
+// waiting for a length prefix and the body size while waiting for a body.
+// Each complete request is handed to the worker pool; no further input is
+// processed until its reply is back. A request waiting on steam_auth is
+// parked here in the meantime.
+class Connection
+{
+public:
+    struct sockaddr_in clientaddr;
+    int conn_fd;
+    uint64_t id;
+    int length;
+    std::string inbuf;
+    std::string outbuf;
+    bool busy = false;
+    Job* parked = NULL;
+    Connection(int conn_fd_, uint64_t id_):
+        conn_fd(conn_fd_),
+        id(id_),
+        length(-1)
+    {
+    }
+
+    // Sockets are registered edge triggered, so every event drains reads and
+    // writes until the kernel reports EAGAIN.
+    void handle_events(WorkerPool& pool, uint32_t events)
+    {
+        if (events & (EPOLLERR | EPOLLHUP))
+        {
+            close();
+            return;
+        }
+        if (events & (EPOLLIN | EPOLLRDHUP))
+        {
+            read_input();
+            process_input(pool);
+        }
+        write_output();
+    }
+
+    void read_input()
+    {
+        char buf[4096];
+        while (conn_fd >= 0)
+        {
+            ssize_t num_bytes_received = recv(conn_fd, buf, sizeof(buf), 0);
             if (num_bytes_received  == -1)
             {
+                if (errno == EINTR)
+                    continue;
                 if (errno != EAGAIN && errno != EWOULDBLOCK)
                     close();
                 break;
             }
             else if (num_bytes_received  == 0)
             {
+                close();
                 break;
             }
-            outbuf.erase(0, num_bytes_received);
-            if (num_bytes_received && outbuf.empty())
+            inbuf.append(buf, num_bytes_received);
+        }
+    }
+
+    void write_output()
+    {
+        while (conn_fd >= 0 && !outbuf.empty())
+        {
+            ssize_t num_bytes_sent = send(conn_fd, outbuf.c_str(), outbuf.length(), MSG_NOSIGNAL);
+            if (num_bytes_sent  == -1)
             {
+                if (errno == EINTR)
+                    continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    close();
+                break;
+            }
+            outbuf.erase(0, num_bytes_sent);
+            if (outbuf.empty())
+                close();
+        }
+    }
+
+    // A job for this connection is back from the pool.
+    void job_done(WorkerPool& pool, Job* job)
+    {
+        busy = false;
+        if (job->failed)
+        {
+            delete job;
+            close();
+            return;
+        }
+        if (job->needs_auth)
+        {
+            if (!steam_auth.start(job->steam_session, job->appid, conn_fd))
+            {
+                std::cout << "Exception curl_easy_init() failed\n";
+                delete job;
                 close();
                 return;
             }
+            parked = job;
+            return;
         }
-        while (true)
+        outbuf.append(job->reply);
+        delete job;
+        process_input(pool);
+        write_output();
+    }
+
+    // The ticket for the parked request has been checked and, if ok, the
+    // result recorded in db.
+    void auth_finished(WorkerPool& pool, bool ok)
+    {
+        Job* job = parked;
+        parked = NULL;
+        if (!ok)
+        {
+            delete job;
+            close();
+            return;
+        }
+        job->authed = true;
+        busy = true;
+        pool.submit(job);
+    }
+
+    void process_input(WorkerPool& pool)
+    {
+        while (conn_fd >= 0 && !busy && !parked)
         {
             if (length < 0 && inbuf.length() >= 4)
             {
@@ -575,224 +1975,18 @@ public:
             }
             else if (length > 0 && (int)inbuf.length() >= length)
             {
-                bool pirate = false;
-                try
-                {
-                    std::string decomp = decompress_string(inbuf);
-                    std::istringstream decomp_stream(decomp);
-                    SaveObjectMap* omap = SaveObject::load(decomp_stream)->get_map();
-                    uint64_t steam_id = omap->get_num("steam_id");
-                    inbuf.erase(0, length);
-                    length = -1;
-                    if (steam_id != SECRET_ID && steam_id != 0)
-                    {
-                        std::string steam_session;
-                        omap->get_string("steam_session", steam_session);
-                        if (!db.steam_sessions.count(steam_session))
-                        {
-                            CURL *curl;
-                            CURLcode res;
-                            curl = curl_easy_init();
-                            if (!curl)
-                            {
-                                close();
-                                throw(std::runtime_error("curl_easy_init() failed"));
-                            }
-
-                            std::string url = "https://partner.steam-api.com/ISteamUserAuth/AuthenticateUserTicket/v1/?key=44D5549D3DC57BCF2492489740F0354A&appid=" + std::string(omap->get_num("demo") ? "2263470" : omap->get_num("playtest") ? "2263480" : "2262930") + "&ticket=" + steam_session;
-
-                            curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    //                        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
-    //                        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
-                            curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10L);
-
-                            std::string response;
-
-                            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_data);
-                            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-
-                            res = curl_easy_perform(curl);
-                            curl_easy_cleanup(curl);
-                            if(res != CURLE_OK)
-                            {
-                                printf("curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-                                throw(std::runtime_error("curl_easy_perform() failed"));
-                            }
-                            std::cout << steam_id  << " " << response << "\n";
-
-                            try
-                            {
-                                SaveObjectMap* omap = SaveObject::load(response)->get_map()->get_item("response")->get_map();
-                                db.steam_sessions[steam_session] = 0;
-                                uint64_t server_steam_id = std::stoull(omap->get_item("params")->get_map()->get_string("steamid"));
-                                db.steam_sessions[steam_session] = server_steam_id;
-                            }
-                            catch (const std::runtime_error& error)
-                            {
-                                std::cout << "Exception " << error.what() << "\n";
-                            }
-                        }
-                        
-                        if (db.steam_sessions.count(steam_session) &&
-                            (db.steam_sessions[steam_session] != steam_id))
-                        {
-                            char ip4[INET_ADDRSTRLEN];
-                            inet_ntop(AF_INET, &(clientaddr.sin_addr), ip4, INET_ADDRSTRLEN);
-                            printf("pirate check failed %s\n", ip4);
-                            pirate = true;
-                            std::cout << "failed:" << steam_id << " - " << db.steam_sessions[steam_session] << "\n";
-                            // omap->save(std::cout);
-                            // close();
-                            // break;
-                        }
-                    }
-                    
-                    std::string command;
-                    omap->get_string("command", command);
-                    int player_version = omap->get_num("version");
-                    if (!pirate && player_version != game_version)
-                    {
-                        throw(std::runtime_error("player_version != game_version"));
-                        // pirate = true;
-                        // printf("old version\n");
-                        // close();
-                        // break;
-                    }
-                    if (pirate)
-                    {
-                        SaveObjectMap* scr = new SaveObjectMap();
-                        scr->add_num("pirate", 1);
-                        std::string s = scr->to_string();
-                        std::string comp = compress_string(s);
-                        uint32_t length = comp.length();
-                        outbuf.append((char*)&length, 4);
-                        outbuf.append(comp);
-                        delete scr;
-                    }
-                    else if (command == "scores")
-                    {
-                        std::string steam_username;
-                        omap->get_string("steam_username", steam_username);
-                        db.update_name(steam_id, steam_username);
-                        int mode = 0;
-                        if (omap->has_key("game_mode"))
-                            mode = omap->get_num("game_mode");
-                        char ip4[INET_ADDRSTRLEN];
-                        inet_ntop(AF_INET, &(clientaddr.sin_addr), ip4, INET_ADDRSTRLEN);
-                        printf("scores: %s [%s] %lu (%d)", steam_username.c_str(), ip4, steam_id, mode);
-
-                        SaveObjectList* progress_list = omap->get_item("level_progress")->get_list();
-                        for (unsigned lset = 0; lset < progress_list->get_count() && lset < LEVEL_TYPES - 1; lset++)
-                        {
-                            if (steam_id == SECRET_ID)
-                                continue;
-                            if (steam_id == 0ull)
-                                continue;
-                            if (omap->has_key("server_levels_version") && (omap->get_num("server_levels_version") != db.server_levels_version))
-                                continue;
-
-
-                            unsigned score = 0;
-                            SaveObjectList* l = progress_list->get_item(lset)->get_list();
-                            for (unsigned lgrp = 0; lgrp < l->get_count() && lgrp < 30; lgrp++)
-                            {
-                                std::string s = l->get_item(lgrp)->get_string();
-                                for (unsigned i = 0; i < s.length() && i < 200; i++)
-                                {
-                                    bool c = (s[i] == '1');
-                                    db.scores[mode][lset].stats[lgrp][i].total++;
-                                    if (c)
-                                    {
-                                        db.scores[mode][lset].stats[lgrp][i].completed++;
-                                        score++;
-                                    }
-                                }
-                            }
-                            db.scores[mode][lset].add_score(steam_id, score);
-                            printf("%u ", score);
-                        }
-                        printf("\n");
-                        std::set<uint64_t> friends;
-                        if (omap->has_key("friends"))
-                        {
-                            SaveObjectList* friend_list = omap->get_item("friends")->get_list();
-                            for (unsigned i = 0; i < friend_list->get_count(); i++)
-                            {
-                                friends.insert(friend_list->get_num(i));
-                            }
-                            friends.insert(omap->get_num("steam_id"));
-                        }
-                        if(omap->has_key("level_gen_req") && omap->has_key("level_gen_resp"))
-                        {
-                            std::string req = omap->get_string("level_gen_req");
-                            std::string resp = omap->get_string("level_gen_resp");
-                            db.add_server_level(req, resp);
-                        }
-
-                        SaveObjectMap* scr = db.get_scores(mode, steam_id, friends);
-
-                        if(omap->has_key("server_levels_version"))
-                        {
-                            if (omap->get_num("server_levels_version") != db.server_levels_version)
-                            {
-                                scr->add_num("server_levels_version", db.server_levels_version);
-                                SaveObjectList* sl_list = new SaveObjectList;
-                                for (std::vector<std::string>& lvl_set : db.server_levels)
-                                {
-                                    SaveObjectList* ssl_list = new SaveObjectList;
-                                    for (std::string& lvl : lvl_set)
-                                    {
-                                        ssl_list->add_string(lvl);
-                                    }
-                                    sl_list->add_item(ssl_list);
-                                }
-                                scr->add_item("server_levels", sl_list);
-                                if (db.neg_server_levels.size())
-                                {
-                                    sl_list = new SaveObjectList;
-                                    for (std::vector<std::string>& lvl_set : db.neg_server_levels)
-                                    {
-                                        
-                                        SaveObjectList* ssl_list = new SaveObjectList;
-                                        for (std::string& lvl : lvl_set)
-                                        {
-                                            ssl_list->add_string(lvl);
-                                        }
-                                        sl_list->add_item(ssl_list);
-                                    }
-                                    scr->add_item("neg_server_levels", sl_list);
-                                }
-                            }
-                        }
-//                        scr->add_num("festivus", 1);
-
-                        std::string s = scr->to_string();
-                        std::string comp = compress_string(s);
-                        uint32_t length = comp.length();
-                        outbuf.append((char*)&length, 4);
-                        outbuf.append(comp);
-                        delete scr;
-                    }
-                    else
-                    {
-                        printf("unknown command: %s \n", command.c_str());
-                        close();
-                    }
-                    
-                    delete omap;
-                }
-                catch (const std::runtime_error& error)
-                {
-                    std::cout << "Exception " << error.what() << "\n";
-                    close();
-                    break;
-                }
+                Job* job = new Job(conn_fd, id, clientaddr);
+                job->request.assign(inbuf, 0, length);
+                inbuf.erase(0, length);
+                length = -1;
+                busy = true;
+                pool.submit(job);
             }
             else
                 break;
         }
     }
-    
+
     void close()
     {
         if (conn_fd < 0)
@@ -800,6 +1994,8 @@ public:
         shutdown(conn_fd, SHUT_RDWR);
         ::close(conn_fd);
         conn_fd = -1;
+        delete parked;
+        parked = NULL;
     }
 
 };
@@ -822,15 +2018,41 @@ int main(int argc, char *argv[])
     signal(SIGTERM, sig_handler);
 
     curl_global_init(CURL_GLOBAL_DEFAULT);
+
+    // -auth-url points ticket checks at a local stand-in, e.g. for load tests.
+    // -threads sets the number of request workers, one per core by default.
+    unsigned thread_count = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-auth-url") && i + 1 < argc)
+            steam_auth.endpoint = argv[++i];
+        else if (!strcmp(argv[i], "-threads") && i + 1 < argc)
+            thread_count = std::max(1, atoi(argv[++i]));
+    }
   
     try 
     {
-        std::ifstream loadfile("db.save");
+        std::ifstream loadfile("db.save", std::ios::binary);
         if (!loadfile.fail() && !loadfile.eof())
         {
-            SaveObjectMap* omap = SaveObject::load(loadfile)->get_map();
-            db.load(omap);
-            delete omap;
+            // Older db.save files are a SaveObject tree, either plain JSON or
+            // compressed, and are rewritten as a snapshot below.
+            std::string data;
+            if (is_zstd_stream(loadfile))
+            {
+                DecompressIStream zloadfile(loadfile);
+                data = read_stream(zloadfile);
+            }
+            else
+                data = read_stream(loadfile);
+            if (Database::is_snapshot(data))
+                db.load_snapshot(data);
+            else if (!data.empty())
+            {
+                SaveObject* sobj = SaveObject::load(data);
+                db.load(sobj);
+                delete sobj;
+            }
         }
     }
     catch (const std::runtime_error& error)
@@ -838,6 +2060,18 @@ int main(int argc, char *argv[])
         std::cout << error.what() << "\n";
     }
 
+    // Bring the snapshot up to date with any logs written after it, then
+    // fold them into a fresh snapshot.
+    Snapshotter snapshotter;
+    for (uint64_t generation : WriteAheadLog::list())
+    {
+        if (generation < db.wal_generation)
+            continue;
+        WriteAheadLog::replay(generation, db);
+        db.wal_generation = generation;
+    }
+    snapshotter.save_now(db);
+
     struct sockaddr_in myaddr ,clientaddr;
     int sockid;
     sockid=socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK , 0);
@@ -850,22 +2084,59 @@ int main(int argc, char *argv[])
         perror("socket");
         return 1;
     }
+    // The server closes each connection, leaving the port in TIME_WAIT.
+    int reuse = 1;
+    setsockopt(sockid, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
     socklen_t len=sizeof(myaddr);
     if(bind(sockid,( struct sockaddr*)&myaddr,len)==-1)
     {
         perror("bind");
         return 1;
     }
-    if(listen(sockid,10)==-1)
+    if(listen(sockid,SOMAXCONN)==-1)
     {
         perror("listen");
         return 1;
     }
-    
-    
-    std::list<Connection> conns;
 
-    time_t old_time = 0;
+    // Each client holds a descriptor, so allow as many as the hard limit.
+    struct rlimit fd_limit;
+    if (getrlimit(RLIMIT_NOFILE, &fd_limit) == 0 && fd_limit.rlim_cur < fd_limit.rlim_max)
+    {
+        fd_limit.rlim_cur = fd_limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &fd_limit);
+    }
+
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd == -1)
+    {
+        perror("epoll_create1");
+        return 1;
+    }
+    {
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.fd = sockid;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sockid, &ev);
+    }
+    steam_auth.init(epoll_fd);
+
+    WorkerPool pool;
+    pool.start(db, thread_count);
+    {
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = pool.event_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pool.event_fd, &ev);
+    }
+
+    std::unordered_map<int, Connection> conns;
+    uint64_t next_conn_id = 0;
+    static const int max_events = 256;
+    struct epoll_event events[max_events];
+    int event_count = 0;
+
+    time_t old_time = time(NULL);
     int week = time(NULL) / 604800;
 
     while(true)
@@ -882,112 +2153,146 @@ int main(int argc, char *argv[])
             std::ifstream loadfile("CLEAR_NEXT_SERVER_LEVELS");
             if (!loadfile.fail() && !loadfile.eof())
             {
-                db.next_server_levels.clear();
-                db.next_neg_server_levels.clear();
+                db.lock_all();
+                wal.append(WriteAheadLog::WAL_CLEAR_NEXT_LEVELS);
+                db.clear_next_server_levels();
+                db.unlock_all();
                 std::remove("CLEAR_NEXT_SERVER_LEVELS");
             }
         }
+        event_count = epoll_wait(epoll_fd, events, max_events, steam_auth.wait_ms(5000));
+        if (event_count < 0)
         {
-            fd_set w_fds;
-            fd_set r_fds;
-            struct timeval timeout;
-            timeout.tv_sec = 5;
-            timeout.tv_usec = 0;
-
-            FD_ZERO(&r_fds);
-            FD_ZERO(&w_fds);
-            FD_SET(sockid, &r_fds);
-            
-            for (Connection &conn :conns)
-            {
-                FD_SET(conn.conn_fd, &r_fds);
-                if (!conn.outbuf.empty())
-                    FD_SET(conn.conn_fd, &w_fds);
-            }
-            
-            select(1024, &r_fds, &w_fds, NULL, &timeout);
+            if (errno != EINTR)
+                perror("epoll_wait");
+            event_count = 0;
         }
         {
             int new_week = time(NULL) / 604800;
             if (week != new_week)
             {
-                db.server_levels = db.next_server_levels;
-                db.next_server_levels.clear();
-                db.neg_server_levels = db.next_neg_server_levels;
-                db.next_neg_server_levels.clear();
-                db.server_levels_version++;
+                db.lock_all();
+                wal.append(WriteAheadLog::WAL_ROLLOVER);
+                db.weekly_rollover();
+                db.unlock_all();
                 week = new_week;
+            }
+        }
 
-                int windex = db.server_levels_version % 10;
-                for (int i = 0; i < GAME_MODE_TYPES; i++)
+        for (int i = 0; i < event_count; i++)
+        {
+            int fd = events[i].data.fd;
+            if (fd == sockid)
+            {
+                while (true)
                 {
-                    db.scores[i][LEVEL_TYPES - 1].reset();
-                    for(auto& [id, val] : db.players)
+                    len = sizeof(clientaddr);
+                    int conn_fd = accept4(sockid, (struct sockaddr *)&clientaddr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                    if (conn_fd == -1)
+                    {
+                        if (errno == EINTR || errno == ECONNABORTED)
+                            continue;
+                        break;
+                    }
+                    struct epoll_event ev = {};
+                    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                    ev.data.fd = conn_fd;
+                    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn_fd, &ev) == -1)
                     {
-                        uint64_t score = 0;
-                        if (db.scores[i][LEVEL_TYPES-2].user_score.count(id))
-                            score = db.scores[i][LEVEL_TYPES-2].user_score[id];
-                        val.weekly_scores[i][windex] = score;
-
-                        score = 0;
-                        for (int j = 1 ; j <= 10; j++)
-                        {
-                            score += val.weekly_scores[i][(j + windex) % 10] * j / 10;
-                        }
-                        if (score)
-                            db.scores[i][LEVEL_TYPES - 1].add_score(id, score);
+                        ::close(conn_fd);
+                        continue;
                     }
-                    db.scores[i][LEVEL_TYPES - 2].reset();
+                    Connection& conn = conns.try_emplace(conn_fd, conn_fd, next_conn_id++).first->second;
+                    conn.clientaddr = clientaddr;
                 }
+                continue;
             }
+            if (fd == pool.event_fd)
+            {
+                for (Job* job : pool.take_done())
+                {
+                    auto it = conns.find(job->conn_fd);
+                    if (it == conns.end() || it->second.id != job->conn_id)
+                    {
+                        delete job;
+                        continue;
+                    }
+                    it->second.job_done(pool, job);
+                    if (it->second.conn_fd < 0)
+                        conns.erase(it);
+                }
+                continue;
+            }
+            if (steam_auth.owns(fd))
+            {
+                steam_auth.socket_ready(fd, events[i].events);
+                continue;
+            }
+            auto it = conns.find(fd);
+            if (it == conns.end())
+                continue;
+            Connection& conn = it->second;
+            conn.handle_events(pool, events[i].events);
+            if (conn.conn_fd < 0)
+                conns.erase(it);
         }
 
-        while (true)
-        {
-            int conn_fd = accept(sockid,(struct sockaddr *)&clientaddr, &len);
-            if (conn_fd == -1)
-                break;
-            if (conn_fd >= 1024)
-                ::close(conn_fd);
-            conns.push_back(conn_fd);
-            conns.back().clientaddr = clientaddr;
-        }
-
-        for (std::list<Connection>::iterator it = conns.begin(); it != conns.end();)
+        steam_auth.check_timeout();
+        for (SteamAuth::Result* result : steam_auth.take_results())
         {
-            Connection& conn = (*it);
-            conn.recieve(db);
-            if (conn.conn_fd < 0)
-                it = conns.erase(it);
-            else
-                it++;
+            if (result->ok)
+            {
+                std::cout << result->response << "\n";
+                SaveObject* sob = NULL;
+                try
+                {
+                    sob = SaveObject::load(result->response);
+                    SaveObjectMap* omap = sob->get_map()->get_item("response")->get_map();
+                    db.store_session(result->ticket, 0);
+                    uint64_t server_steam_id = std::stoull(omap->get_item("params")->get_map()->get_string("steamid"));
+                    db.store_session(result->ticket, server_steam_id);
+                }
+                catch (const std::exception& error)
+                {
+                    std::cout << "Exception " << error.what() << "\n";
+                }
+                delete sob;
+            }
+            for (int fd : result->waiters)
+            {
+                auto it = conns.find(fd);
+                if (it == conns.end() || !it->second.parked || it->second.parked->steam_session != result->ticket)
+                    continue;
+                it->second.auth_finished(pool, result->ok);
+                if (it->second.conn_fd < 0)
+                    conns.erase(it);
+            }
+            delete result;
         }
 
+        wal.flush();
         fflush(stdout);
         if (power_down)
             break;
 
         time_t new_time;
         time(&new_time);
-        if ((old_time + 60 * 5) < new_time)
+        if ((old_time + 60 * 5) < new_time && !snapshotter.busy())
         {
-            SaveObject* savobj = db.save(false);
-            std::string out_data = savobj->to_string();
-            std::ofstream outfile ("db.save");
-            outfile << out_data;
-            delete savobj;
+            snapshotter.start(db);
             old_time = new_time;
+            std::lock_guard<std::mutex> guard(db.sessions_mutex);
+            printf("sessions: %zu cached, %lu hits, %lu misses\n", db.steam_sessions.size(), db.steam_sessions.hits, db.steam_sessions.misses);
         }
     }
+    pool.stop();
+    for (auto& [fd, conn] : conns)
+        conn.close();
+    steam_auth.cleanup();
+    close(epoll_fd);
     close(sockid);
-    if (1)
-    {
-        SaveObject* savobj = db.save(false);
-        std::string out_data = savobj->to_string();
-        std::ofstream outfile ("db.save");
-        outfile << out_data;
-        delete savobj;
-    }
+    snapshotter.save_now(db);
+    wal.close();
     curl_global_cleanup();
     return 0;
 }
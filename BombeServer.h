@@ -0,0 +1,5 @@
+#pragma once
+
+// The protocol version BombeServer accepts. Requests carrying any other
+// version are turned away, so this moves with GameState::game_version.
+static const int game_version = 14;
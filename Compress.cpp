@@ -4,6 +4,9 @@
 #include <iomanip>
 #include <sstream>
 #include <string.h>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
 
 #include <zstd.h>
 
@@ -609,53 +612,254 @@ static const unsigned char dictionary[dictionary_len] = {
   0x65, 0x22, 0x3a, 0x32, 0x35, 0x36, 0x30, 0x30, 0x2c, 0x22, 0x72, 0x65,
   0x67, 0x69, 0x6f, 0x6e, 0x5f
 };
-std::string compress_string_zstd(const std::string& str, int level)
+// Digested dictionaries are immutable once built so they are shared by all
+// threads. Contexts are not, so each thread keeps its own. The mutex is only
+// taken to build a dictionary, so threads compressing at the same time do
+// not queue on it.
+
+static std::mutex dict_mutex;
+static const int max_cdict_level = 31;
+static std::atomic<ZSTD_CDict*> cdicts[max_cdict_level + 1] = {};
+static std::atomic<ZSTD_DDict*> ddict{NULL};
+
+static int clamp_level(int level)
 {
-    if (level < 0)
-        level = ZSTD_maxCLevel();
-    size_t buf_size = ZSTD_compressBound(str.size());
-    char* buf = (char*) malloc(buf_size);
-    
-    ZSTD_CCtx* const cctx = ZSTD_createCCtx();
-    ZSTD_CDict* const cdict = ZSTD_createCDict(dictionary, dictionary_len, level);
-    
-    size_t got_size = ZSTD_compress_usingCDict(cctx, buf, buf_size, str.c_str(), str.size(), cdict);
-    std::string outstring;
-    outstring.append(buf, got_size);
-    ZSTD_freeCCtx(cctx);
-    ZSTD_freeCDict(cdict);
-    free(buf);
+    if (level < 0 || level > ZSTD_maxCLevel() || level > max_cdict_level)
+        level = std::min(ZSTD_maxCLevel(), max_cdict_level);
+    return level;
+}
 
-    return outstring;
+static ZSTD_CDict* get_cdict(int level)
+{
+    ZSTD_CDict* cdict = cdicts[level].load(std::memory_order_acquire);
+    if (cdict)
+        return cdict;
+    std::lock_guard<std::mutex> guard(dict_mutex);
+    cdict = cdicts[level].load(std::memory_order_relaxed);
+    if (!cdict)
+    {
+        cdict = ZSTD_createCDict(dictionary, dictionary_len, level);
+        cdicts[level].store(cdict, std::memory_order_release);
+    }
+    return cdict;
 }
 
-std::string decompress_string_zstd(const std::string& str)
+static ZSTD_DDict* get_ddict()
 {
-    unsigned long long buf_size = ZSTD_getFrameContentSize(str.c_str(), str.size());
-    if (!buf_size || buf_size > 10000000)
-        throw(std::runtime_error("ZSTD failed"));
+    ZSTD_DDict* dict = ddict.load(std::memory_order_acquire);
+    if (dict)
+        return dict;
+    std::lock_guard<std::mutex> guard(dict_mutex);
+    dict = ddict.load(std::memory_order_relaxed);
+    if (!dict)
+    {
+        dict = ZSTD_createDDict(dictionary, dictionary_len);
+        ddict.store(dict, std::memory_order_release);
+    }
+    return dict;
+}
+
+class ZstdContexts
+{
+public:
+    ZSTD_CCtx* cctx = NULL;
+    ZSTD_DCtx* dctx = NULL;
+    ~ZstdContexts()
+    {
+        ZSTD_freeCCtx(cctx);
+        ZSTD_freeDCtx(dctx);
+    }
+    ZSTD_CCtx* get_cctx()
+    {
+        if (!cctx)
+            cctx = ZSTD_createCCtx();
+        return cctx;
+    }
+    ZSTD_DCtx* get_dctx()
+    {
+        if (!dctx)
+            dctx = ZSTD_createDCtx();
+        return dctx;
+    }
+};
+
+static thread_local ZstdContexts zstd_contexts;
+
+size_t compress_bound(size_t size)
+{
+    return ZSTD_compressBound(size);
+}
 
+size_t compress_zstd_into(const char* src, size_t src_size, char* dst, size_t dst_capacity, int level)
+{
+    ZSTD_CDict* cdict = get_cdict(clamp_level(level));
+    size_t got_size = ZSTD_compress_usingCDict(zstd_contexts.get_cctx(), dst, dst_capacity, src, src_size, cdict);
+    if (ZSTD_isError(got_size))
+        throw(std::runtime_error("ZSTD failed"));
+    return got_size;
+}
 
-    char* buf = (char*) malloc(buf_size);
-    
-    ZSTD_DCtx* const dctx = ZSTD_createDCtx();
-    ZSTD_DDict* const ddict = ZSTD_createDDict(dictionary, dictionary_len);    
-    
-    size_t got_size = ZSTD_decompress_usingDDict(dctx, buf, buf_size, str.c_str(), str.size(), ddict);
-    if (!got_size)
+size_t decompressed_size_zstd(const char* src, size_t src_size)
+{
+    unsigned long long buf_size = ZSTD_getFrameContentSize(src, src_size);
+    if (!buf_size || buf_size > 10000000)
         throw(std::runtime_error("ZSTD failed"));
-    if (got_size > 10000000)
+    return buf_size;
+}
+
+size_t decompress_zstd_into(const char* src, size_t src_size, char* dst, size_t dst_capacity)
+{
+    size_t got_size = ZSTD_decompress_usingDDict(zstd_contexts.get_dctx(), dst, dst_capacity, src, src_size, get_ddict());
+    if (ZSTD_isError(got_size) || !got_size)
         throw(std::runtime_error("ZSTD failed"));
-        
-    
+    return got_size;
+}
+
+std::string compress_string_zstd(const std::string& str, int level)
+{
     std::string outstring;
-    outstring.append(buf, got_size);
-    ZSTD_freeDCtx(dctx);
-    ZSTD_freeDDict(ddict);
-    free(buf);
+    outstring.resize(compress_bound(str.size()));
+    outstring.resize(compress_zstd_into(str.data(), str.size(), outstring.data(), outstring.size(), level));
+    return outstring;
+}
+
+std::string decompress_string_zstd(const std::string& str)
+{
+    if (ZSTD_getFrameContentSize(str.data(), str.size()) == ZSTD_CONTENTSIZE_UNKNOWN)
+    {
+        // Written by the streaming compressor, which does not know the size
+        // up front.
+        std::istringstream in(str);
+        DecompressIStream zin(in);
+        std::string outstring;
+        char buf[4096];
+        while (zin.read(buf, sizeof(buf)) || zin.gcount())
+        {
+            outstring.append(buf, zin.gcount());
+            if (outstring.size() > 10000000)
+                throw(std::runtime_error("ZSTD failed"));
+        }
+        return outstring;
+    }
+    std::string outstring;
+    outstring.resize(decompressed_size_zstd(str.data(), str.size()));
+    outstring.resize(decompress_zstd_into(str.data(), str.size(), outstring.data(), outstring.size()));
     return outstring;
 }
 
+CompressStreamBuf::CompressStreamBuf(std::ostream& sink_, int level):
+    sink(sink_)
+{
+    cctx = ZSTD_createCCtx();
+    ZSTD_CCtx_refCDict(cctx, get_cdict(clamp_level(level)));
+    in_buf.resize(ZSTD_CStreamInSize());
+    out_buf.resize(ZSTD_CStreamOutSize());
+    setp(in_buf.data(), in_buf.data() + in_buf.size());
+}
+
+CompressStreamBuf::~CompressStreamBuf()
+{
+    finish();
+    ZSTD_freeCCtx(cctx);
+}
+
+bool CompressStreamBuf::compress(bool end)
+{
+    ZSTD_inBuffer input = {pbase(), size_t(pptr() - pbase()), 0};
+    while (true)
+    {
+        ZSTD_outBuffer output = {out_buf.data(), out_buf.size(), 0};
+        size_t remaining = ZSTD_compressStream2(cctx, &output, &input, end ? ZSTD_e_end : ZSTD_e_continue);
+        if (ZSTD_isError(remaining))
+            return false;
+        sink.write(out_buf.data(), output.pos);
+        if (end ? (remaining == 0) : (input.pos == input.size))
+            break;
+    }
+    setp(in_buf.data(), in_buf.data() + in_buf.size());
+    return bool(sink);
+}
+
+int CompressStreamBuf::overflow(int c)
+{
+    if (finished || !compress(false))
+        return traits_type::eof();
+    if (c != traits_type::eof())
+    {
+        *pptr() = c;
+        pbump(1);
+    }
+    return traits_type::not_eof(c);
+}
+
+int CompressStreamBuf::sync()
+{
+    if (finished)
+        return 0;
+    return compress(false) ? 0 : -1;
+}
+
+void CompressStreamBuf::finish()
+{
+    if (finished)
+        return;
+    compress(true);
+    sink.flush();
+    finished = true;
+}
+
+DecompressStreamBuf::DecompressStreamBuf(std::istream& source_):
+    source(source_)
+{
+    dctx = ZSTD_createDCtx();
+    ZSTD_DCtx_refDDict(dctx, get_ddict());
+    in_buf.resize(ZSTD_DStreamInSize());
+    out_buf.resize(ZSTD_DStreamOutSize());
+    setg(out_buf.data(), out_buf.data(), out_buf.data());
+}
+
+DecompressStreamBuf::~DecompressStreamBuf()
+{
+    ZSTD_freeDCtx(dctx);
+}
+
+int DecompressStreamBuf::underflow()
+{
+    while (true)
+    {
+        if (in_pos == in_size)
+        {
+            source.read(in_buf.data(), in_buf.size());
+            in_size = source.gcount();
+            in_pos = 0;
+            if (!in_size)
+                return traits_type::eof();
+        }
+        ZSTD_inBuffer input = {in_buf.data(), in_size, in_pos};
+        ZSTD_outBuffer output = {out_buf.data(), out_buf.size(), 0};
+        size_t ret = ZSTD_decompressStream(dctx, &output, &input);
+        if (ZSTD_isError(ret))
+            throw(std::runtime_error("ZSTD failed"));
+        in_pos = input.pos;
+        if (output.pos)
+        {
+            setg(out_buf.data(), out_buf.data(), out_buf.data() + output.pos);
+            return traits_type::to_int_type(*gptr());
+        }
+    }
+}
+
+bool is_zstd_stream(std::istream& stream)
+{
+    std::streampos pos = stream.tellg();
+    unsigned char magic[4] = {};
+    stream.read((char*)magic, 4);
+    bool got = (stream.gcount() == 4);
+    stream.clear();
+    stream.seekg(pos);
+    return got && (magic[0] == 0x28) && (magic[1] == 0xB5) && (magic[2] == 0x2F) && (magic[3] == 0xFD);
+}
+
 std::string decompress_string(const std::string& str)
 {
     return decompress_string_zstd(str);
@@ -665,3 +869,22 @@ std::string compress_string(const std::string& str, int level)
 {
     return compress_string_zstd(str, level);
 }
+
+std::string compress_string(const std::string& str, CompressProfile profile)
+{
+    return compress_string_zstd(str, compress_profile_level(profile));
+}
+
+int compress_profile_level(CompressProfile profile)
+{
+    switch (profile)
+    {
+        case COMPRESS_INTERACTIVE:
+            return 1;
+        case COMPRESS_NETWORK:
+            return 1;
+        case COMPRESS_ARCHIVE:
+            return 19;
+    }
+    return -1;
+}
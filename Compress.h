@@ -1,9 +1,89 @@
 #pragma once
 #include <string>
+#include <istream>
+#include <ostream>
+#include <vector>
+
+// Compression level by use case. Measured with CompressBench.
+enum CompressProfile
+{
+    COMPRESS_INTERACTIVE,       // Local files rewritten often, e.g. the robot cache
+    COMPRESS_NETWORK,           // Client and server messages
+    COMPRESS_ARCHIVE,           // Saves, levels.data and clipboard exports
+};
+int compress_profile_level(CompressProfile profile);
 
 std::string compress_string_zstd(const std::string& str, int level = -1);
 std::string decompress_string_zstd(const std::string& str);
 
 std::string compress_string(const std::string& str, int level = -1);
+std::string compress_string(const std::string& str, CompressProfile profile);
 std::string decompress_string(const std::string& str);
 
+
+// Buffer based variants for callers which manage their own memory.
+// Contexts are cached per thread and dictionaries per level.
+size_t compress_bound(size_t size);
+size_t compress_zstd_into(const char* src, size_t src_size, char* dst, size_t dst_capacity, int level = -1);
+size_t decompressed_size_zstd(const char* src, size_t src_size);
+size_t decompress_zstd_into(const char* src, size_t src_size, char* dst, size_t dst_capacity);
+
+// Streaming variants for large payloads such as saves, robot caches and
+// db.save. Output is written to, or input read from, another stream as it
+// goes so neither side is held in memory as one flat buffer.
+typedef struct ZSTD_CCtx_s ZSTD_CCtx;
+typedef struct ZSTD_DCtx_s ZSTD_DCtx;
+
+class CompressStreamBuf : public std::streambuf
+{
+public:
+    CompressStreamBuf(std::ostream& sink, int level);
+    ~CompressStreamBuf();
+    void finish();
+protected:
+    int overflow(int c);
+    int sync();
+private:
+    bool compress(bool end);
+    std::ostream& sink;
+    ZSTD_CCtx* cctx;
+    std::vector<char> in_buf;
+    std::vector<char> out_buf;
+    bool finished = false;
+};
+
+class DecompressStreamBuf : public std::streambuf
+{
+public:
+    DecompressStreamBuf(std::istream& source);
+    ~DecompressStreamBuf();
+protected:
+    int underflow();
+private:
+    std::istream& source;
+    ZSTD_DCtx* dctx;
+    std::vector<char> in_buf;
+    std::vector<char> out_buf;
+    size_t in_pos = 0;
+    size_t in_size = 0;
+};
+
+class CompressOStream : public std::ostream
+{
+public:
+    CompressOStream(std::ostream& sink, int level = -1) : std::ostream(&buf), buf(sink, level) {}
+    CompressOStream(std::ostream& sink, CompressProfile profile) : std::ostream(&buf), buf(sink, compress_profile_level(profile)) {}
+    void finish() {flush(); buf.finish();}
+private:
+    CompressStreamBuf buf;
+};
+
+class DecompressIStream : public std::istream
+{
+public:
+    DecompressIStream(std::istream& source) : std::istream(&buf), buf(source) {}
+private:
+    DecompressStreamBuf buf;
+};
+
+bool is_zstd_stream(std::istream& stream);
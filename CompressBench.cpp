@@ -0,0 +1,144 @@
+#include "SaveState.h"
+#include "Compress.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <zstd.h>
+
+// Measures compression ratio against time at every zstd level over real
+// payloads, e.g. a client save, db.save, lang.json or captured score
+// responses. Compressed inputs are decompressed first. Reports JSON so the
+// levels behind the CompressProfile names can be picked from data.
+//
+//  CompressBench [-l max_level] [-o out.json] [payload ...]
+
+static uint64_t get_time_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static std::string load_payload(std::string filename)
+{
+    std::ifstream loadfile(filename, std::ios::binary);
+    if (loadfile.fail())
+        throw(std::runtime_error("Could not open " + filename));
+    std::stringstream str_stream;
+    if (is_zstd_stream(loadfile))
+    {
+        DecompressIStream zloadfile(loadfile);
+        str_stream << zloadfile.rdbuf();
+    }
+    else
+        str_stream << loadfile.rdbuf();
+    return str_stream.str();
+}
+
+// Repeat until at least 100ms has passed so small payloads get stable timings.
+static uint64_t time_compress(const std::string& payload, int level, std::string& comp)
+{
+    unsigned reps = 0;
+    uint64_t start = get_time_ns();
+    uint64_t now;
+    do
+    {
+        comp = compress_string_zstd(payload, level);
+        reps++;
+        now = get_time_ns();
+    } while (now - start < 100000000);
+    return (now - start) / reps;
+}
+
+static uint64_t time_decompress(const std::string& comp)
+{
+    unsigned reps = 0;
+    uint64_t start = get_time_ns();
+    uint64_t now;
+    do
+    {
+        decompress_string_zstd(comp);
+        reps++;
+        now = get_time_ns();
+    } while (now - start < 100000000);
+    return (now - start) / reps;
+}
+
+int main(int argc, char* argv[])
+{
+    int max_level = ZSTD_maxCLevel();
+    const char* out_filename = NULL;
+    std::vector<std::string> filenames;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-l") && i + 1 < argc)
+            max_level = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+            out_filename = argv[++i];
+        else
+            filenames.push_back(argv[i]);
+    }
+    if (filenames.empty())
+        filenames.push_back("lang.json");
+
+    SaveObjectMap* omap = new SaveObjectMap;
+    SaveObjectMap* profiles = new SaveObjectMap;
+    profiles->add_num("interactive", compress_profile_level(COMPRESS_INTERACTIVE));
+    profiles->add_num("network", compress_profile_level(COMPRESS_NETWORK));
+    profiles->add_num("archive", compress_profile_level(COMPRESS_ARCHIVE));
+    omap->add_item("profiles", profiles);
+
+    SaveObjectList* payload_list = new SaveObjectList;
+    for (std::string& filename : filenames)
+    {
+        std::string payload;
+        try
+        {
+            payload = load_payload(filename);
+        }
+        catch (const std::runtime_error& error)
+        {
+            std::cerr << error.what() << "\n";
+            continue;
+        }
+        SaveObjectMap* pmap = new SaveObjectMap;
+        pmap->add_string("name", filename);
+        pmap->add_num("size", payload.size());
+        SaveObjectList* level_list = new SaveObjectList;
+        for (int level = 1; level <= max_level; level++)
+        {
+            std::string comp;
+            uint64_t compress_ns = time_compress(payload, level, comp);
+            uint64_t decompress_ns = time_decompress(comp);
+            SaveObjectMap* lmap = new SaveObjectMap;
+            lmap->add_num("level", level);
+            lmap->add_num("size", comp.size());
+            lmap->add_num("ratio_x1000", comp.size() ? payload.size() * 1000 / comp.size() : 0);
+            lmap->add_num("compress_ns", compress_ns);
+            lmap->add_num("decompress_ns", decompress_ns);
+            lmap->add_num("compress_mb_per_sec", compress_ns ? payload.size() * 1000 / compress_ns : 0);
+            level_list->add_item(lmap);
+        }
+        pmap->add_item("levels", level_list);
+        payload_list->add_item(pmap);
+    }
+    omap->add_item("payloads", payload_list);
+
+    if (out_filename)
+    {
+        std::ofstream outfile(out_filename);
+        omap->pretty_print(outfile);
+        outfile << "\n";
+    }
+    else
+    {
+        omap->pretty_print(std::cout);
+        std::cout << "\n";
+    }
+    delete omap;
+    return 0;
+}
@@ -75,7 +75,7 @@ static int robot_thread_func(void *ptr)
     return 0;
 }
 
-GameState::GameState(std::string& load_data, bool json)
+GameState::GameState(std::istream& load_stream, bool json)
 {
     global_mutex = SDL_CreateMutex();
     level_gen_mutex = SDL_CreateMutex();
@@ -87,8 +87,8 @@ GameState::GameState(std::string& load_data, bool json)
         level_progress[k][j].resize(((k == 4) ? second_global_level_sets : global_level_sets)[j].size());
         for (unsigned i = 0; i < global_level_sets[j].size(); i++)
         {
-            level_progress[k][j][i].level_status.resize(((k == 4) ? second_global_level_sets : global_level_sets)[j][i]->levels.size());
-            level_progress[k][j][i].count_todo = ((k == 4) ? second_global_level_sets : global_level_sets)[j][i]->levels.size();
+            level_progress[k][j][i].level_status.resize(((k == 4) ? second_global_level_sets : global_level_sets)[j][i]->size());
+            level_progress[k][j][i].count_todo = ((k == 4) ? second_global_level_sets : global_level_sets)[j][i]->size();
         }
     }
     {
@@ -109,10 +109,10 @@ GameState::GameState(std::string& load_data, bool json)
         key_codes[k] = default_key_codes[k];
     try
     {
-        if (!load_data.empty())
+        if (load_stream.peek() != EOF)
         {
             SaveObjectMap* omap;
-            omap = SaveObject::load(load_data)->get_map();
+            omap = SaveObject::load(load_stream)->get_map();
             int version = omap->get_num("version");
             bool check_incoming_rules = true;
             if (omap->has_key("rule_check_version"))
@@ -351,9 +351,9 @@ GameState::GameState(std::string& load_data, bool json)
     SDL_SetTextureBlendMode(overlay_texture, SDL_BLENDMODE_BLEND);
     clear_overlay();
 
-    for (std::map<std::string, SaveObject*>::iterator it = lang_data->omap.begin(); it != lang_data->omap.end(); ++it)
+    for (SaveObjectMap::Map::iterator it = lang_data->omap.begin(); it != lang_data->omap.end(); ++it)
     {
-        std::string s = it->first;
+        std::string s(it->first);
         std::string filename = lang_data->get_item(s)->get_map()->get_string("font");
         if (!fonts.count(filename))
             fonts[filename] = TTF_OpenFont(filename.c_str(), 32);
@@ -448,7 +448,6 @@ GameState::GameState(std::string& load_data, bool json)
     run_robot_count = robot_count;
     for (int i = 0; i < robot_count; i++)
     {
-        robot_lock[i] = SDL_CreateMutex();
         RobotThread* rt = new RobotThread{this, i};
         robot_threads[i] = SDL_CreateThread(robot_thread_func, "Robot", (void *)rt);
     }
@@ -457,6 +456,7 @@ GameState::GameState(std::string& load_data, bool json)
 
 SaveObject* GameState::save(bool lite)
 {
+    SaveArena::Scope arena(save_arena_size);
     SaveObjectMap* omap = new SaveObjectMap;
     omap->add_num("version", game_version);
     omap->add_num("rule_check_version", rule_check_version);
@@ -558,6 +558,29 @@ SaveObject* GameState::save(bool lite)
     if (april_1st)
         omap->add_num("april_1st_hint_count", april_1st_hint_count);
 
+    save_arena_size = arena.used() + arena.used() / 8;
+    return arena.finish(omap);
+}
+
+SaveObject* GameState::save_rule_profile()
+{
+    SaveObjectMap* omap = new SaveObjectMap;
+    omap->add_num("game_mode", game_mode);
+    SaveObjectList* rlist = new SaveObjectList;
+    int index = 0;
+    for (GridRule& rule : rules[game_mode])
+    {
+        if (rule.deleted)
+            continue;
+        SaveObjectMap* rmap = new SaveObjectMap;
+        rmap->add_num("index", index++);
+        rmap->add_item("rule", rule.save(true));
+        rmap->add_num("used", rule.used_count);
+        rmap->add_num("cleared", rule.clear_count);
+        rmap->add_item("profile", rule.profile.save());
+        rlist->add_item(rmap);
+    }
+    omap->add_item("rules", rlist);
     return omap;
 }
 
@@ -631,8 +654,8 @@ void GameState::reset_levels()
         for (unsigned i = 0; i < ((game_mode == 4) ? second_global_level_sets : global_level_sets)[j].size(); i++)
         {
             level_progress[game_mode][j][i].level_status.clear();
-            level_progress[game_mode][j][i].level_status.resize(((game_mode == 4) ? second_global_level_sets : global_level_sets)[j][i]->levels.size());
-            level_progress[game_mode][j][i].count_todo = ((game_mode == 4) ? second_global_level_sets : global_level_sets)[j][i]->levels.size();
+            level_progress[game_mode][j][i].level_status.resize(((game_mode == 4) ? second_global_level_sets : global_level_sets)[j][i]->size());
+            level_progress[game_mode][j][i].count_todo = ((game_mode == 4) ? second_global_level_sets : global_level_sets)[j][i]->size();
             level_progress[game_mode][j][i].star_anim_prog = 0;
             level_progress[game_mode][j][i].unlock_anim_prog = 0;
         }
@@ -747,6 +770,31 @@ static int level_gen_thread_func(void *ptr)
     return 0;
 }
 
+static SaveObject* recv_from_server(TCPsocket tcpsock)
+{
+    uint32_t length;
+    unsigned got = SDLNet_TCP_Recv(tcpsock, (char*)&length, 4);
+    if (got != 4)
+        throw(std::runtime_error("Connection closed early"));
+    char* data = (char*)malloc(length);
+    got = 0;
+    while (got != length)
+    {
+        int n = SDLNet_TCP_Recv(tcpsock, &data[got], length - got);
+        got += n;
+        if (!n)
+        {
+            free (data);
+            throw(std::runtime_error("Connection closed early"));
+        }
+    }
+    std::string in_str(data, length);
+    free (data);
+    std::string decomp = decompress_string(in_str);
+    std::istringstream decomp_stream(decomp);
+    return SaveObject::load(decomp_stream);
+}
+
 static int fetch_from_server_thread(void *ptr)
 {
     IPaddress ip;
@@ -784,9 +832,7 @@ static int fetch_from_server_thread(void *ptr)
 
     try
     {
-        std::ostringstream stream;
-        comms->send->save(stream);
-        std::string comp = compress_string(stream.str());
+        std::string comp = compress_string(comms->send->to_binary(), COMPRESS_NETWORK);
 
         uint32_t length = comp.length();
         SDLNet_TCP_Send(tcpsock, (char*)&length, 4);
@@ -794,26 +840,14 @@ static int fetch_from_server_thread(void *ptr)
 
         if (comms->resp)
         {
-            unsigned got = SDLNet_TCP_Recv(tcpsock, (char*)&length, 4);
-            if (got != 4)
-                throw(std::runtime_error("Connection closed early"));
-            char* data = (char*)malloc(length);
-            got = 0;
-            while (got != length)
-            {
-                int n = SDLNet_TCP_Recv(tcpsock, &data[got], length - got);
-                got += n;
-                if (!n)
-                {
-                    free (data);
-                    throw(std::runtime_error("Connection closed early"));
-                }
-            }
-            std::string in_str(data, length);
-            free (data);
-            std::string decomp = decompress_string(in_str);
-            std::istringstream decomp_stream(decomp);
-            comms->resp->resp = SaveObject::load(decomp_stream);
+            comms->resp->resp = recv_from_server(tcpsock);
+            // A split response is followed by the part shared by all players
+            // and, if ours is out of date, the server level pool.
+            SaveObjectMap* omap = comms->resp->resp->get_map();
+            if (omap->has_key("shared") && omap->get_num("shared"))
+                comms->resp->shared = recv_from_server(tcpsock);
+            if (omap->has_key("levels") && omap->get_num("levels"))
+                comms->resp->levels = recv_from_server(tcpsock);
         }
     }
     catch (const std::runtime_error& error)
@@ -863,6 +897,10 @@ void GameState::fetch_from_server(SaveObject* send, ServerResp* resp)
     resp->error = false;
     delete resp->resp;
     resp->resp = NULL;
+    delete resp->shared;
+    resp->shared = NULL;
+    delete resp->levels;
+    resp->levels = NULL;
     SDL_Thread *thread = SDL_CreateThread(fetch_from_server_thread, "FetchFromServer", (void *)new ServerComms(send, resp));
     SDL_DetachThread(thread);
 }
@@ -882,6 +920,7 @@ void GameState::fetch_scores()
     omap->add_num("playtest", IS_PLAYTEST);
     omap->add_num("version", game_version);
     omap->add_num("game_mode", game_mode);
+    omap->add_num("shared_scores", 1);
     SaveObjectList* pplist = new SaveObjectList;
     for (int j = 0; j <= GLBAL_LEVEL_SETS; j++)
     {
@@ -1040,20 +1079,79 @@ void GameState::load_grid(std::string s)
         right_panel_mode = RIGHT_MENU_NONE;
 
 }
-static int advance_grid(Grid* grid, std::list<GridRule>& rules, GridRegion* inspected_region, const XYSet& filter_pos_and, const XYSet& filter_pos_not, bool skip_hide = false);
-
 void GameState::pause_robots(bool restart_all)
 {
     if (restart_all)
         restart_robots_on_all_levels = true;
-    if (!run_robots)
-        return;
+    SDL_LockMutex(level_progress_lock);
+    SDL_AtomicIncRef(&robot_rules_generation);
+    SDL_UnlockMutex(level_progress_lock);
     run_robots = false;
-    for (int i = 0; i < robot_count; i++)
-        SDL_LockMutex(robot_lock[i]);
+}
 
-    for (int i = 0; i < robot_count; i++)
-        SDL_UnlockMutex(robot_lock[i]);
+void GameState::publish_robot_rules()
+{
+    std::shared_ptr<RobotRuleSet> rule_set = std::make_shared<RobotRuleSet>();
+    rule_set->generation = SDL_AtomicGet(&robot_rules_generation);
+    rule_set->game_mode = game_mode;
+    for (GridRule& rule : rules[game_mode])
+    {
+        if (rule.deleted)
+            continue;
+        rule_set->rules.push_back(rule);
+        GridRule* copy = &rule_set->rules.back();
+        rule_set->originals[copy] = &rule;
+        uint64_t fp = RobotCache::rule_fingerprint(rule);
+        rule_set->fingerprints[copy] = fp;
+        if (!rule.paused)
+            rule_set->active[fp] = copy;
+    }
+    std::vector<uint64_t> fingerprints;
+    for (auto& [fp, rule] : rule_set->active)
+        fingerprints.push_back(fp);
+    rule_set->cache_rule_set = robot_cache.add_rule_set(fingerprints);
+    SDL_AtomicLock(&robot_rule_set_lock);
+    robot_rule_set.swap(rule_set);
+    SDL_AtomicUnlock(&robot_rule_set_lock);
+}
+
+std::shared_ptr<GameState::RobotRuleSet> GameState::get_robot_rules()
+{
+    SDL_AtomicLock(&robot_rule_set_lock);
+    std::shared_ptr<RobotRuleSet> rule_set = robot_rule_set;
+    SDL_AtomicUnlock(&robot_rule_set_lock);
+    return rule_set;
+}
+
+int GameState::robot_active_count()
+{
+    return std::min(run_robot_count, SDL_AtomicGet(&robot_throttle_count));
+}
+
+bool GameState::robot_parked(int thread_index)
+{
+    return thread_index >= robot_active_count();
+}
+
+void GameState::throttle_robots(unsigned frame_time, unsigned elapsed)
+{
+    robot_frame_time = robot_frame_time * 0.9 + frame_time * 0.1;
+    robot_throttle_timer -= elapsed;
+    if (robot_throttle_timer > 0)
+        return;
+    robot_throttle_timer = 500;
+    if (!run_robots)
+        return;
+    if (robot_frame_time > robot_frame_budget)
+    {
+        SDL_AtomicSet(&robot_throttle_count, std::max(1, robot_active_count() - 1));
+        SDL_AtomicSet(&robot_batch_steps, std::max(1, SDL_AtomicGet(&robot_batch_steps) / 2));
+    }
+    else if (robot_frame_time < robot_frame_budget * 0.6)
+    {
+        SDL_AtomicSet(&robot_throttle_count, std::min(robot_count, SDL_AtomicGet(&robot_throttle_count) + 1));
+        SDL_AtomicSet(&robot_batch_steps, std::min(64, SDL_AtomicGet(&robot_batch_steps) * 2));
+    }
 }
 
 void GameState::robot_thread(int thread_index)
@@ -1066,22 +1164,22 @@ void GameState::robot_thread(int thread_index)
         unsigned level_index;
     };
 
-    
-    SDL_LockMutex(robot_lock[thread_index]);
-
     while (true)
     {
-        if (!run_robots || run_robot_count <= thread_index)
+        while (!run_robots || robot_parked(thread_index))
         {
-            SDL_UnlockMutex(robot_lock[thread_index]);
-            while (!run_robots || run_robot_count <= thread_index)
-            {
-                if (SHUTDOWN)
-                    return;
-                SDL_Delay(100);
-            }
-            SDL_LockMutex(robot_lock[thread_index]);
+            if (SHUTDOWN)
+                return;
+            SDL_Delay(100);
         }
+        std::shared_ptr<RobotRuleSet> rule_set = get_robot_rules();
+        if (!rule_set || rule_set->generation != SDL_AtomicGet(&robot_rules_generation))
+        {
+            SDL_Delay(10);
+            continue;
+        }
+        int game_mode = rule_set->game_mode;
+
         RobotJob job;
         {
             SDL_LockMutex(level_progress_lock);
@@ -1135,7 +1233,7 @@ void GameState::robot_thread(int thread_index)
                     }
                 }
             }
-            if (jobs_todo.empty())
+            if (jobs_todo.empty() || rule_set->generation != SDL_AtomicGet(&robot_rules_generation))
             {
                 SDL_UnlockMutex(level_progress_lock);
                 SDL_Delay(100);
@@ -1147,44 +1245,90 @@ void GameState::robot_thread(int thread_index)
             SDL_UnlockMutex(level_progress_lock);
         }
 
-        Grid* grid = Grid::Load((job.level_group_index == GLBAL_LEVEL_SETS) ?
+        const std::string& level = (job.level_group_index == GLBAL_LEVEL_SETS) ?
                         ((game_mode == 4) ? neg_server_levels : server_levels)[job.level_set_index][job.level_index] :
-                        ((game_mode == 4) ? second_global_level_sets : global_level_sets)[job.level_group_index][job.level_set_index]->levels[job.level_index]);
+                        ((game_mode == 4) ? second_global_level_sets : global_level_sets)[job.level_group_index][job.level_set_index]->get(job.level_index);
+
+        int cached_regions;
+        if (robot_cache.lookup(game_mode, level, rule_set->cache_rule_set, rule_set->active, rule_limit_count, cached_regions))
+        {
+            SDL_LockMutex(level_progress_lock);
+            if (rule_set->generation == SDL_AtomicGet(&robot_rules_generation))
+            {
+                LevelStatus& status = level_progress[game_mode][job.level_group_index][job.level_set_index].level_status[job.level_index];
+                status.robot_done = 3;
+                status.robot_regions = cached_regions;
+            }
+            SDL_UnlockMutex(level_progress_lock);
+            continue;
+        }
 
+        Grid* grid = grid_templates.get(level);
+
+        int robot_done = 1;
+        int robot_regions = 0;
+        int batch_steps = 0;
         while (true)
         {
             static const XYSet emptyFilter{};
-            int rep = advance_grid(grid, rules[game_mode], NULL, emptyFilter, emptyFilter, true);
+            int rep = advance_grid(grid, rule_set->rules, NULL, emptyFilter, emptyFilter, true);
 
             if (rep == 0)
             {
-                if (grid->is_solved())
-                {
-                    SDL_LockMutex(level_progress_lock);
-                    if (!level_progress[game_mode][job.level_group_index][job.level_set_index].level_status[job.level_index].done)
-                    {
-                        level_progress[game_mode][job.level_group_index][job.level_set_index].count_todo--;
-                        level_progress[game_mode][job.level_group_index][job.level_set_index].level_status[job.level_index].done = true;
-                        robot_solved_counts[job.level_group_index]++;
-                    }
-                    SDL_UnlockMutex(level_progress_lock);
-                }
-                level_progress[game_mode][job.level_group_index][job.level_set_index].level_status[job.level_index].robot_done = 3;
+                robot_done = 3;
                 break;
             }
             {
                 int region_count = grid->regions.size();
+                robot_regions = region_count;
                 level_progress[game_mode][job.level_group_index][job.level_set_index].level_status[job.level_index].robot_regions = region_count;
                 if(rule_limit_count >= 0 && region_count > rule_limit_count)
                 {
-                    level_progress[game_mode][job.level_group_index][job.level_set_index].level_status[job.level_index].robot_done = 2;
+                    robot_done = 2;
                     break;
                 }
             }
-            if (!run_robots)
+            if (!run_robots || rule_set->generation != SDL_AtomicGet(&robot_rules_generation))
                 break;
+            if (++batch_steps >= SDL_AtomicGet(&robot_batch_steps))
+            {
+                batch_steps = 0;
+                while (robot_parked(thread_index) && run_robots && !SHUTDOWN)
+                    SDL_Delay(10);
+            }
         }
-        grid->commit_level_counts();
+
+        // A completed run is a valid cache entry for the rule set it ran
+        // against even if that has since been replaced.
+        if (robot_done == 3 && !grid->is_solved())
+            robot_cache.store(game_mode, level, rule_set->cache_rule_set, grid, rule_set->fingerprints);
+
+        // Results and rule statistics only count if the rules have not
+        // changed underneath us; the originals may have been freed otherwise.
+        SDL_LockMutex(level_progress_lock);
+        if (rule_set->generation == SDL_AtomicGet(&robot_rules_generation))
+        {
+            LevelStatus& status = level_progress[game_mode][job.level_group_index][job.level_set_index].level_status[job.level_index];
+            if (robot_done == 3 && grid->is_solved() && !status.done)
+            {
+                level_progress[game_mode][job.level_group_index][job.level_set_index].count_todo--;
+                status.done = true;
+                robot_solved_counts[job.level_group_index]++;
+            }
+            if (robot_done > 1)
+            {
+                status.robot_done = robot_done;
+                status.robot_regions = robot_regions;
+            }
+            grid->flush_rule_profiles();
+            for (auto [rule, count] : grid->level_used_count)
+                rule_set->originals[rule]->used_count += count;
+            for (auto [rule, count] : grid->level_clear_count)
+                rule_set->originals[rule]->clear_count += count;
+            for (auto& [rule, prof] : grid->level_profile)
+                rule_set->originals[rule]->profile.add(prof);
+        }
+        SDL_UnlockMutex(level_progress_lock);
         delete grid;
     }
 }
@@ -1199,7 +1343,11 @@ void GameState::advance(int steps)
         {
             GridRule& r = load_rules[mode].front();
             if (rule_is_permitted(r, mode, true))
+            {
                 rules[mode].push_back(r);
+                if (mode == game_mode && run_robots)
+                    pause_robots(false);
+            }
             load_rules[mode].pop_front();
             if (load_limit-- < 0)
                 break;
@@ -1207,6 +1355,7 @@ void GameState::advance(int steps)
     }
     if (!run_robots && should_run_robots)
     {
+        SDL_LockMutex(level_progress_lock);
         for (unsigned g = 0; g < GLBAL_LEVEL_SETS + 1; g++)
         {
             for (unsigned s = 0; s < level_progress[game_mode][g].size(); s++)
@@ -1220,6 +1369,8 @@ void GameState::advance(int steps)
                 }
             }
         }
+        SDL_UnlockMutex(level_progress_lock);
+        publish_robot_rules();
         run_robots = true;
         restart_robots_on_all_levels = false;
     }
@@ -1375,9 +1526,9 @@ void GameState::advance(int steps)
                 while (level_progress[game_mode][current_level_group_index][current_level_set_index].level_status[current_level_index].done);
             }
 
-            std::string& s = (current_level_group_index == GLBAL_LEVEL_SETS) ?
+            const std::string& s = (current_level_group_index == GLBAL_LEVEL_SETS) ?
                         ((game_mode == 4) ? neg_server_levels : server_levels)[current_level_set_index][current_level_index] :
-                        ((game_mode == 4) ? second_global_level_sets : global_level_sets)[current_level_group_index][current_level_set_index]->levels[current_level_index];
+                        ((game_mode == 4) ? second_global_level_sets : global_level_sets)[current_level_group_index][current_level_set_index]->get(current_level_index);
             load_grid(s);
         }
         else
@@ -1510,19 +1661,20 @@ void GameState::advance(int steps)
     }
 
     unsigned oldtime = SDL_GetTicks();
+    int idx = -1;
     for (GridRule& rule : rules[game_mode])
     {
+        idx++;
         if (rule.deleted)
             continue;
         if (rule.stale)
             continue;
         if (rule.paused)
             continue;
-        unsigned oldtime = SDL_GetTicks();
-        Grid::ApplyRuleResp resp  = grid->apply_rule(rule, (GridRegion*) NULL);
-        unsigned newtime = SDL_GetTicks();
-        if (newtime - oldtime)
-            rule.cpu_time += newtime - oldtime;
+        RuleProfile& prof = grid->rule_profile(idx, &rule);
+        Uint64 start_count = SDL_GetPerformanceCounter();
+        Grid::ApplyRuleResp resp  = grid->apply_rule(rule, (GridRegion*) NULL, prof);
+        prof.ns += (SDL_GetPerformanceCounter() - start_count) * 1000000000 / SDL_GetPerformanceFrequency();
         if (resp == Grid::APPLY_RULE_RESP_HIT)
             return;
         rule.stale = true;
@@ -1574,128 +1726,6 @@ void GameState::advance(int steps)
     }
 }
 
-static int advance_grid(Grid* grid, std::list<GridRule>& rules, GridRegion* inspected_region, const XYSet& filter_pos_and, const XYSet& filter_pos_not, bool skip_hide)
-{
-    grid->add_base_regions();
-    // for (GridRegion& r : grid->regions)
-    //     r.stale = true;
-    
-    GridRegion* new_region = grid->add_one_new_region(inspected_region, filter_pos_and, filter_pos_not);
-
-    if (!new_region)
-        return 0;
-
-    if (!new_region->stale)
-    {
-        for (int i = 1; i < 3; i++)
-        {
-            for (GridRule& rule : rules)
-            {
-                if (rule.deleted)
-                    continue;
-                if (rule.paused)
-                    continue;
-                if (rule.apply_region_type.type == RegionType::VISIBILITY && rule.apply_region_type.value == i)
-                {
-                    if (skip_hide && rule.apply_region_type.value == 1)
-                        continue;
-                    unsigned oldtime = SDL_GetTicks();
-                    Grid::ApplyRuleResp resp  = grid->apply_rule(rule, new_region);
-                    unsigned newtime = SDL_GetTicks();
-                    if (newtime - oldtime)
-                        rule.cpu_time += newtime - oldtime;
-                    if (resp == Grid::APPLY_RULE_RESP_HIT)
-                        break;
-                }
-            }
-        }
-        return 2;
-    }
-
-    if (new_region->vis_level != GRID_VIS_LEVEL_BIN)
-    {
-        for (GridRule& rule : rules)
-        {
-            if (rule.paused)
-                continue;
-            if (rule.deleted)
-                continue;
-            if (rule.apply_region_type.type == RegionType::VISIBILITY)
-                continue;
-            if (rule.apply_region_type.type == RegionType::SET)
-                continue;
-            {
-                unsigned oldtime = SDL_GetTicks();
-                grid->apply_rule(rule, new_region);
-                unsigned newtime = SDL_GetTicks();
-                if (newtime - oldtime)
-                    rule.cpu_time += newtime - oldtime;
-            }
-        }
-    }
-
-    if (!new_region->deleted)
-    {
-        int idx = -1;
-        for (GridRule& rule : rules)
-        {
-            idx++;
-            if (rule.deleted)
-                continue;
-            if (rule.paused)
-                continue;
-            if (rule.apply_region_type.type != RegionType::SET)
-                continue;
-            unsigned oldtime = SDL_GetTicks();
-            Grid::ApplyRuleResp resp  = grid->apply_rule(rule, new_region);
-            unsigned newtime = SDL_GetTicks();
-            if (newtime - oldtime)
-                rule.cpu_time += newtime - oldtime;
-            if (resp == Grid::APPLY_RULE_RESP_HIT)
-            {
-                new_region->stale = false;
-                for (GridRegion& r : grid->regions)
-                {
-                    if (r.vis_cause.rule && (
-                        (r.vis_cause.regions[0] && r.vis_cause.regions[0]->deleted) ||
-                        (r.vis_cause.regions[1] && r.vis_cause.regions[1]->deleted) ||
-                        (r.vis_cause.regions[2] && r.vis_cause.regions[2]->deleted) ||
-                        (r.vis_cause.regions[3] && r.vis_cause.regions[3]->deleted) ))
-                    {
-                        r.vis_cause = GridRegionCause();
-                        GridVisLevel prev = r.vis_level;
-                        r.vis_level = GRID_VIS_LEVEL_SHOW;
-                        for (int i = 1; i < 3; i++)
-                        {
-                            for (GridRule& rule : rules)
-                            {
-                                if (rule.deleted)
-                                    continue;
-                                if (rule.paused)
-                                    continue;
-                                if (rule.apply_region_type.type == RegionType::VISIBILITY && rule.apply_region_type.value == i)
-                                {
-                                    if (skip_hide && rule.apply_region_type.value == 1)
-                                        continue;
-                                    unsigned oldtime = SDL_GetTicks();
-                                    grid->apply_rule(rule, &r, false);
-                                    unsigned newtime = SDL_GetTicks();
-                                    if (newtime - oldtime)
-                                        rule.cpu_time += newtime - oldtime;
-                                }
-                            }
-                        }
-                        if ((r.vis_level != prev) && (prev == GRID_VIS_LEVEL_BIN))
-                            r.stale = false;
-                    }
-                }
-                return 1;
-            }
-        }
-    }
-    return 2;
-}
-
 void GameState::audio()
 {
 }
@@ -4113,7 +4143,7 @@ void GameState::render(bool saving)
                 }
                 if (cpu_debug && (col == 6))
                 {
-                    if (a.rule->cpu_time < b.rule->cpu_time)
+                    if (a.rule->profile.ns < b.rule->profile.ns)
                         return true;
                     else
                         return false;
@@ -4127,16 +4157,16 @@ void GameState::render(bool saving)
                         a_.rule->apply_region_type.type != RegionType::VISIBILITY)
                             return true;
 
-                    if (!a.rule->clear_count && a.rule->cpu_time)
+                    if (!a.rule->clear_count && a.rule->profile.ns)
                         return false;
-                    if (!b.rule->clear_count && b.rule->cpu_time)
+                    if (!b.rule->clear_count && b.rule->profile.ns)
                         return true;
 
-                    double fa = (double)a.rule->cpu_time / (double)a.rule->clear_count;
-                    double fb = (double)b.rule->cpu_time / (double)b.rule->clear_count;
-                    if (!a.rule->cpu_time)
+                    double fa = (double)a.rule->profile.ns / (double)a.rule->clear_count;
+                    double fb = (double)b.rule->profile.ns / (double)b.rule->clear_count;
+                    if (!a.rule->profile.ns)
                         fa = 0;
-                    if (!b.rule->cpu_time)
+                    if (!b.rule->profile.ns)
                         fb = 0;
 
                     return fa < fb;
@@ -4296,10 +4326,20 @@ void GameState::render(bool saving)
             {
                 if(display_rules_cpu)
                 {
-                    render_number(rule.cpu_time, list_pos + XYPos(6 * cell_width, cell_width + y_offset + cell_height*0.25), XYPos(cell_width * 9 / 10, cell_height*5/10),XYPos(1,0));
+                    render_number(rule.profile.cpu_ms(), list_pos + XYPos(6 * cell_width, cell_width + y_offset + cell_height*0.25), XYPos(cell_width * 9 / 10, cell_height*5/10),XYPos(1,0));
+                    {
+                        const RuleProfile& prof = rule.profile;
+                        std::string tip = "Calls " + std::to_string(prof.invocations) +
+                                          "\nTried " + std::to_string(prof.candidates) +
+                                          "\nRejected " + std::to_string(prof.rejected[0]) + " " + std::to_string(prof.rejected[1]) + " " + std::to_string(prof.rejected[2]) + " " + std::to_string(prof.rejected[3]) +
+                                          "\nHits " + std::to_string(prof.hits) +
+                                          "\nns " + std::to_string(prof.ns);
+                        SDL_Rect dst_rect = {list_pos.x + 6 * cell_width, list_pos.y + cell_width + y_offset, cell_width, cell_height};
+                        add_tooltip(dst_rect, tip.c_str(), false);
+                    }
                     if (rule.clear_count)
                     {
-                        double f = (double)rule.cpu_time / (double)rule.clear_count;
+                        double f = (double)rule.profile.ns / 1000000 / (double)rule.clear_count;
                         std::ostringstream out;
                         out << std::fixed << std::setprecision(6) << f;
                         std::string s = std::move(out).str();
@@ -4313,7 +4353,7 @@ void GameState::render(bool saving)
                     }
                     else if (rule.apply_region_type.type != RegionType::VISIBILITY)
                     {
-                        if (!rule.cpu_time)
+                        if (!rule.profile.ns)
                         {
                             render_number_string("0", list_pos + XYPos(7 * cell_width, cell_width + y_offset + cell_height*0.25), XYPos(cell_width * 9 / 10, cell_height*5/10),XYPos(1,0));
                         }
@@ -4418,6 +4458,7 @@ void GameState::render(bool saving)
                                 }
                                 rules[game_mode].splice(to, rules[game_mode], from);
                             }
+                            pause_robots(false);
                         }
                     }
                 }
@@ -5330,7 +5371,7 @@ void GameState::render(bool saving)
             }
             int cnt = (current_level_group_index == GLBAL_LEVEL_SETS) ?
                             ((game_mode == 4) ? neg_server_levels : server_levels)[i].size() :
-                            ((game_mode == 4) ? second_global_level_sets : global_level_sets)[current_level_group_index][i]->levels.size();
+                            ((game_mode == 4) ? second_global_level_sets : global_level_sets)[current_level_group_index][i]->size();
 
             if (!cnt || (IS_DEMO && (i % 5 + i / 5) > 3))
             {
@@ -6150,7 +6191,7 @@ void GameState::render(bool saving)
             }
             {
                 render_box(right_panel_offset + XYPos(button_size * 2, button_size * 3), XYPos(button_size, button_size), button_size/4, 4);
-                render_number(run_robot_count, XYPos(right_panel_offset.x + 2 * button_size, right_panel_offset.y + button_size * 3.25), XYPos(button_size * 0.9, button_size/2));
+                render_number(robot_active_count(), XYPos(right_panel_offset.x + 2 * button_size, right_panel_offset.y + button_size * 3.25), XYPos(button_size * 0.9, button_size/2));
                 SDL_Rect dst_rect = {right_panel_offset.x + 2 * button_size, right_panel_offset.y + button_size * 3, button_size, button_size};
                 add_tooltip(dst_rect, "Robots", false);
             }
@@ -7173,9 +7214,9 @@ void GameState::render(bool saving)
         render_box(left_panel_offset + XYPos(button_size, button_size), XYPos(13 * button_size, 10 * button_size), button_size/4, 1);
         int index = 0;
         std::string orig_lang = language;
-        for (std::map<std::string, SaveObject*>::iterator it = lang_data->omap.begin(); it != lang_data->omap.end(); ++it)
+        for (SaveObjectMap::Map::iterator it = lang_data->omap.begin(); it != lang_data->omap.end(); ++it)
         {
-            std::string s = it->first;
+            std::string s(it->first);
             set_language(s);
             if (s == orig_lang)
                 SDL_SetTextureColorMod(sdl_texture, 0, contrast, 0);
@@ -7791,9 +7832,11 @@ void GameState::right_panel_click(XYPos pos, int clicks, int btn)
             {
                 rule->used_count = 0;
                 rule->clear_count = 0;
-                rule->cpu_time = 0;
+                rule->profile = RuleProfile();
                 grid->level_used_count[rule] = 0;
                 grid->level_clear_count[rule] = 0;
+                grid->flush_rule_profiles();
+                grid->level_profile[rule] = RuleProfile();
             }
         }
         if ((pos - XYPos(button_size * 3, button_size * 6)).inside(XYPos(button_size, button_size)))
@@ -8360,7 +8403,7 @@ void GameState::right_panel_click(XYPos pos, int clicks, int btn)
                     {
                         if (rule_is_permitted(constructed_rule, game_mode))
                         {
-                            constructed_rule.cpu_time = 0;
+                            constructed_rule.profile = RuleProfile();
                             pause_robots();
                             std::list<GridRule>::iterator it;
                             for (it = rules[game_mode].begin(); it != rules[game_mode].end(); it++)
@@ -9197,11 +9240,11 @@ bool GameState::events()
                     {
                         int want = p.y + (p.x / 6) * 8;
                         int index = 0;
-                        for (std::map<std::string, SaveObject*>::iterator it = lang_data->omap.begin(); it != lang_data->omap.end(); ++it)
+                        for (SaveObjectMap::Map::iterator it = lang_data->omap.begin(); it != lang_data->omap.end(); ++it)
                         {
                             if (index == want)
                             {
-                                set_language(it->first);
+                                set_language(std::string(it->first));
                             }
                             index++;
                         }
@@ -9603,25 +9646,58 @@ void GameState::deal_with_scores()
                 }
                 else
                     pirate = 0;
-                SaveObjectList* lvls = omap->get_item("scores")->get_list();
+                // Split responses carry the top lists and stats separately
+                // and list our own and friends' rows in friend_scores.
+                SaveObjectMap* shared = scores_from_server.shared ? scores_from_server.shared->get_map() : omap;
+                SaveObjectList* lvls = shared->get_item("scores")->get_list();
+                SaveObjectList* friend_lvls = omap->has_key("friend_scores") ? omap->get_item("friend_scores")->get_list() : NULL;
                 for (int i = 0; i < GLBAL_LEVEL_SETS + 2; i++)
                 {
-                    SaveObjectList* scores = lvls->get_item(i)->get_list();
                     int mode = omap->get_num("game_mode");
                     score_tables[mode][i].clear();
-                    for (unsigned j = 0; j < scores->get_count(); j++)
+                    // The shared lists may be a little older than
+                    // friend_scores, so a player whose rank has since moved
+                    // would show twice. Their friend_scores row wins.
+                    SaveObjectList* friend_list = friend_lvls ? friend_lvls->get_item(i)->get_list() : NULL;
+                    std::vector<int64_t> friend_keys;
+                    if (friend_list)
+                        for (unsigned j = 0; j < friend_list->get_count(); j++)
+                        {
+                            SaveObjectMap* score = friend_list->get_item(j)->get_map();
+                            if (score->has_key("key"))
+                                friend_keys.push_back(score->get_num("key"));
+                        }
+                    for (SaveObjectList* scores : {lvls->get_item(i)->get_list(), friend_list})
                     {
-                        SaveObjectMap* score = scores->get_item(j)->get_map();
-                        unsigned is_friend = 0;
-                        if (score->has_key("friend"))
-                            is_friend = score->get_num("friend");
-                        unsigned hidden = 0;
-                        if (score->has_key("hidden"))
-                            hidden = score->get_num("hidden");
-                        score_tables[mode][i].push_back(PlayerScore(unsigned(score->get_num("pos")), score->get_string("name"), unsigned(score->get_num("score")), is_friend, hidden));
+                        if (!scores)
+                            continue;
+                        for (unsigned j = 0; j < scores->get_count(); j++)
+                        {
+                            SaveObjectMap* score = scores->get_item(j)->get_map();
+                            if (scores != friend_list && score->has_key("key") && std::find(friend_keys.begin(), friend_keys.end(), score->get_num("key")) != friend_keys.end())
+                                continue;
+                            unsigned is_friend = 0;
+                            if (score->has_key("friend"))
+                                is_friend = score->get_num("friend");
+                            unsigned hidden = 0;
+                            if (score->has_key("hidden"))
+                                hidden = score->get_num("hidden");
+                            PlayerScore row(unsigned(score->get_num("pos")), score->get_string("name"), unsigned(score->get_num("score")), is_friend, hidden);
+                            bool replaced = false;
+                            for (PlayerScore& old : score_tables[mode][i])
+                            {
+                                if (old.pos == row.pos)
+                                {
+                                    old = row;
+                                    replaced = true;
+                                }
+                            }
+                            if (!replaced)
+                                score_tables[mode][i].push_back(row);
+                        }
                     }
                 }
-                lvls = omap->get_item("stats")->get_list();
+                lvls = shared->get_item("stats")->get_list();
                 for (unsigned i = 0; i <= GLBAL_LEVEL_SETS; i++)
                 {
                     SaveObjectList* stats1 = lvls->get_item(i)->get_list();
@@ -9647,11 +9723,12 @@ void GameState::deal_with_scores()
                         SDL_UnlockMutex(level_gen_mutex);
                     }
                 }
-                if (omap->has_key("server_levels"))
+                SaveObjectMap* levels = scores_from_server.levels ? scores_from_server.levels->get_map() : omap;
+                if (levels->has_key("server_levels"))
                 {
                     server_level_anim = 0;
-                    server_levels_version = omap->get_num("server_levels_version");
-                    SaveObjectList* lvl_sets = omap->get_item("server_levels")->get_list();
+                    server_levels_version = levels->get_num("server_levels_version");
+                    SaveObjectList* lvl_sets = levels->get_item("server_levels")->get_list();
                     server_levels.clear();
                     server_levels.resize(lvl_sets->get_count());
                     for (unsigned m = 0; m < GAME_MODES - 1; m++)
@@ -9677,9 +9754,9 @@ void GameState::deal_with_scores()
                     if (current_level_group_index == GLBAL_LEVEL_SETS)
                         current_level_is_temp = true;
                 }
-                if (omap->has_key("neg_server_levels"))
+                if (levels->has_key("neg_server_levels"))
                 {
-                    SaveObjectList* lvl_sets = omap->get_item("neg_server_levels")->get_list();
+                    SaveObjectList* lvl_sets = levels->get_item("neg_server_levels")->get_list();
                     neg_server_levels.clear();
                     neg_server_levels.resize(lvl_sets->get_count());
                     int m = GAME_MODES - 1;
@@ -9713,6 +9790,10 @@ void GameState::deal_with_scores()
             if (scores_from_server.resp)
                 delete scores_from_server.resp;
             scores_from_server.resp = NULL;
+            delete scores_from_server.shared;
+            scores_from_server.shared = NULL;
+            delete scores_from_server.levels;
+            scores_from_server.levels = NULL;
         }
         else
             server_timeout = 1000 * 60;
@@ -9748,7 +9829,7 @@ void GameState::send_to_clipboard(std::string title, SaveObject* obj)
     }
     else
     {
-        std::string comp = compress_string_zstd(str);
+        std::string comp = compress_string(str, COMPRESS_ARCHIVE);
         std::u32string s32;
         s32 += 0x1F4A3;                 // unicode Bomb 
         unsigned spaces = 2;
@@ -9778,7 +9859,7 @@ void GameState::send_rule_to_img_clipboard(GridRule& rule)
     std::ostringstream stream;
     omap->save(stream);
     delete omap;
-    std::string comp = compress_string(stream.str());
+    std::string comp = compress_string(stream.str(), COMPRESS_ARCHIVE);
 
     XYPos siz;
     if (rule.neg_reg_count)
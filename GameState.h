@@ -3,6 +3,7 @@
 #include "SaveState.h"
 #include "Grid.h"
 #include "LevelSet.h"
+#include "RobotCache.h"
 
 #include <SDL.h>
 #include <SDL_image.h>
@@ -12,6 +13,7 @@
 #include <map>
 #include <list>
 #include <set>
+#include <memory>
 #include <algorithm>
 #include <iterator>
 
@@ -21,6 +23,8 @@ extern bool IS_PLAYTEST;
 struct ServerResp
 {
     SaveObject* resp = NULL;
+    SaveObject* shared = NULL;
+    SaveObject* levels = NULL;
     bool done = false;
     bool error = false;
     SDL_SpinLock working = 0;
@@ -323,11 +327,39 @@ public:
 
     const static int max_robot_count = 64;
     SDL_Thread* robot_threads[max_robot_count] = {};
-    SDL_mutex* robot_lock[max_robot_count];
+
+    // Immutable copy of rules[game_mode] that the robots solve against.
+    // A new one is published from advance() whenever the rules change and
+    // robots pick it up at their next level boundary.
+    class RobotRuleSet
+    {
+    public:
+        int generation = 0;
+        int game_mode = 0;
+        std::list<GridRule> rules;
+        std::map<GridRule*, GridRule*> originals;
+        std::map<GridRule*, uint64_t> fingerprints;
+        std::map<uint64_t, GridRule*> active;
+        int cache_rule_set = 0;
+    };
+    std::shared_ptr<RobotRuleSet> robot_rule_set;
+    SDL_SpinLock robot_rule_set_lock = 0;
+    SDL_atomic_t robot_rules_generation = {};
+    RobotCache robot_cache;
+    GridTemplateCache grid_templates;
 
     int robot_count = 0;
     int run_robot_count  = 0;
     bool run_robots = false;
+
+    // Adaptive limit on top of run_robot_count which keeps the main loop
+    // within its frame budget. Robots above the limit park at their next
+    // batch boundary. Set by the main thread, read by the robots.
+    const static int robot_frame_budget = 10;
+    SDL_atomic_t robot_throttle_count = {max_robot_count};
+    SDL_atomic_t robot_batch_steps = {16};
+    float robot_frame_time = 0;
+    int robot_throttle_timer = 0;
     bool should_run_robots = false;
     bool restart_robots_on_all_levels = false;
 
@@ -501,8 +533,11 @@ public:
     unsigned text_entry_offset = 0;
     std::string* text_entry_string = NULL;
 
-    GameState(std::string& lost_data, bool json);
+    size_t save_arena_size = 1 << 16;
+
+    GameState(std::istream& load_stream, bool json);
     SaveObject* save(bool lite = false);
+    SaveObject* save_rule_profile();
     void save(std::ostream& outfile, bool lite = false);
     ~GameState();
     void reset_levels();
@@ -516,7 +551,12 @@ public:
     bool rule_is_permitted(GridRule& rule, int mode, bool legal_check = false);
     void load_grid(std::string s);
     void pause_robots(bool restart_all = true);
+    void publish_robot_rules();
+    std::shared_ptr<RobotRuleSet> get_robot_rules();
     void robot_thread(int index);
+    int robot_active_count();
+    bool robot_parked(int thread_index);
+    void throttle_robots(unsigned frame_time, unsigned elapsed);
     void advance(int steps);
     void audio();
     void set_language(std::string lang);
@@ -5,6 +5,7 @@
 #include <bit>
 #include <sstream>
 #include <algorithm>
+#include <chrono>
 
 bool IS_DEMO = false;
 bool IS_PLAYTEST = false;
@@ -362,8 +363,10 @@ GridRule::GridRule(SaveObject* sobj)
         used_count = omap->get_num("used_count");
     if (omap->has_key("clear_count"))
         clear_count = omap->get_num("clear_count");
-    if (omap->has_key("cpu_time"))
-        cpu_time = omap->get_num("cpu_time");
+    if (omap->has_key("profile"))
+        profile.load(omap->get_item("profile"));
+    else if (omap->has_key("cpu_time"))
+        profile.ns = uint64_t(omap->get_num("cpu_time")) * 1000000;
     if (omap->has_key("comment"))
         comment = omap->get_string("comment");
 
@@ -373,6 +376,32 @@ GridRule::GridRule(SaveObject* sobj)
     // assert(rep == GridRule::OK || rep == GridRule::LOSES_DATA);
 }
 
+void RuleProfile::load(SaveObject* sob)
+{
+    SaveObjectMap* omap = sob->get_map();
+    invocations = omap->get_num("invocations");
+    candidates = omap->get_num("candidates");
+    SaveObjectList* rlist = omap->get_item("rejected")->get_list();
+    for (unsigned i = 0; i < rlist->get_count() && i < 4; i++)
+        rejected[i] = rlist->get_num(i);
+    hits = omap->get_num("hits");
+    ns = omap->get_num("ns");
+}
+
+SaveObject* RuleProfile::save()
+{
+    SaveObjectMap* omap = new SaveObjectMap;
+    omap->add_num("invocations", invocations);
+    omap->add_num("candidates", candidates);
+    SaveObjectList* rlist = new SaveObjectList;
+    for (int i = 0; i < 4; i++)
+        rlist->add_num(rejected[i]);
+    omap->add_item("rejected", rlist);
+    omap->add_num("hits", hits);
+    omap->add_num("ns", ns);
+    return omap;
+}
+
 SaveObject* GridRule::save(bool lite)
 {
     SaveObjectMap* omap = new SaveObjectMap;
@@ -400,7 +429,8 @@ SaveObject* GridRule::save(bool lite)
     {
         omap->add_num("used_count", used_count);
         omap->add_num("clear_count", clear_count);
-        omap->add_num("cpu_time", cpu_time);
+        omap->add_num("cpu_time", profile.cpu_ms());
+        omap->add_item("profile", profile.save());
     }
     if (comment != "")
         omap->add_string("comment", comment);
@@ -2323,8 +2353,254 @@ void Grid::from_string(std::string s)
     // }
 }
 
+// Packed levels start with 0xF0 | shape, which can never begin a text level,
+// followed by a little endian bit stream:
+//   size.x, size.y: 6 bits each, wrapped: 2 bits
+//   innie_pos: 6 + 6 bits, only for WRAPPED_IN
+//   merged count: 8 bits, then 6 bits for each coordinate of each entry
+//   edge count: 8 bits, then x, y: 6 bits each, type: 5 bits, value: 8 bits
+//   bomb, revealed and negated bitmaps over get_squares(), the negated one
+//   only present if a 1 bit flag says so
+//   clue value width: 4 bits, then for each non bomb square a 5 bit clue
+//   type followed by its value when the type is not NONE
+
+class LevelBitWriter
+{
+public:
+    std::string out;
+    uint64_t acc = 0;
+    unsigned bits = 0;
+
+    void put(unsigned value, unsigned width)
+    {
+        acc |= uint64_t(value & ((1u << width) - 1)) << bits;
+        bits += width;
+        while (bits >= 8)
+        {
+            out.push_back(char(acc));
+            acc >>= 8;
+            bits -= 8;
+        }
+    }
+
+    void finish()
+    {
+        if (bits)
+            out.push_back(char(acc));
+        acc = 0;
+        bits = 0;
+    }
+};
+
+class LevelBitReader
+{
+public:
+    const uint8_t* pos;
+    const uint8_t* end;
+    uint64_t acc = 0;
+    unsigned bits = 0;
+
+    LevelBitReader(const char* data, size_t size) : pos((const uint8_t*)data), end((const uint8_t*)data + size) {}
+
+    unsigned get(unsigned width)
+    {
+        while (bits < width)
+        {
+            if (pos >= end)
+                throw(std::runtime_error("Bad packed level"));
+            acc |= uint64_t(*pos++) << bits;
+            bits += 8;
+        }
+        unsigned value = acc & ((1u << width) - 1);
+        acc >>= width;
+        bits -= width;
+        return value;
+    }
+};
+
+std::string Grid::to_packed()
+{
+    LevelBitWriter w;
+    w.put(0xF0 | shape(), 8);
+    w.put(size.x, 6);
+    w.put(size.y, 6);
+    w.put(wrapped, 2);
+    if (wrapped == WRAPPED_IN)
+    {
+        w.put(innie_pos.x, 6);
+        w.put(innie_pos.y, 6);
+    }
+    assert(merged.size() < 256 && edges.size() < 256);
+    w.put(merged.size(), 8);
+    for (const auto &m_reg : merged)
+    {
+        w.put(m_reg.first.x, 6);
+        w.put(m_reg.first.y, 6);
+        w.put(m_reg.second.x, 6);
+        w.put(m_reg.second.y, 6);
+    }
+    w.put(edges.size(), 8);
+    for (const auto &m_reg : edges)
+    {
+        w.put(m_reg.first.x, 6);
+        w.put(m_reg.first.y, 6);
+        w.put(m_reg.second.type, 5);
+        w.put(uint8_t(m_reg.second.value), 8);
+    }
+
+    std::vector<GridPlace*> places;
+    XYSet grid_squares = get_squares();
+    FOR_XY_SET(p, grid_squares)
+        places.push_back(&vals[p]);
+    bool any_negated = false;
+    unsigned max_value = 0;
+    for (GridPlace* g : places)
+    {
+        any_negated |= g->negated;
+        if (!g->bomb && g->clue.type != RegionType::NONE)
+            max_value = std::max(max_value, unsigned(uint8_t(g->clue.value)));
+    }
+    for (GridPlace* g : places)
+        w.put(g->bomb, 1);
+    for (GridPlace* g : places)
+        w.put(g->revealed, 1);
+    w.put(any_negated, 1);
+    if (any_negated)
+        for (GridPlace* g : places)
+            w.put(g->negated, 1);
+
+    unsigned value_bits = 0;
+    while (max_value >> value_bits)
+        value_bits++;
+    w.put(value_bits, 4);
+    for (GridPlace* g : places)
+    {
+        if (g->bomb)
+            continue;
+        assert(g->clue.type < 32);
+        w.put(g->clue.type, 5);
+        if (g->clue.type != RegionType::NONE)
+            w.put(uint8_t(g->clue.value), value_bits);
+    }
+    w.finish();
+    return w.out;
+}
+
+// Decodes straight into vals. Squares come out of get_squares() in the same
+// order as the map's keys so every insert lands at the end.
+void Grid::from_packed(const std::string& s)
+{
+    LevelBitReader r(s.data(), s.size());
+    r.get(8);
+    size.x = r.get(6);
+    size.y = r.get(6);
+    wrapped = WrapType(r.get(2));
+    if (wrapped == WRAPPED_IN)
+    {
+        innie_pos.x = r.get(6);
+        innie_pos.y = r.get(6);
+    }
+    unsigned count = r.get(8);
+    for (unsigned i = 0; i < count; i++)
+    {
+        XYPos mp;
+        XYPos ms;
+        mp.x = r.get(6);
+        mp.y = r.get(6);
+        ms.x = r.get(6);
+        ms.y = r.get(6);
+        merged.emplace_hint(merged.end(), mp, ms);
+    }
+    count = r.get(8);
+    for (unsigned i = 0; i < count; i++)
+    {
+        XYPos mp;
+        RegionType t;
+        mp.x = r.get(6);
+        mp.y = r.get(6);
+        t.type = RegionType::Type(r.get(5));
+        t.value = int8_t(r.get(8));
+        edges.emplace_hint(edges.end(), mp, t);
+    }
+
+    std::vector<XYPos> squares;
+    XYSet grid_squares = get_squares();
+    FOR_XY_SET(p, grid_squares)
+        squares.push_back(p);
+    std::vector<uint8_t> bombs(squares.size());
+    for (uint8_t& bomb : bombs)
+        bomb = r.get(1);
+    for (unsigned i = 0; i < squares.size(); i++)
+        vals.emplace_hint(vals.end(), squares[i], GridPlace(bombs[i], r.get(1)));
+    if (r.get(1))
+        for (auto& [p, g] : vals)
+            g.negated = r.get(1);
+
+    unsigned value_bits = r.get(4);
+    for (auto& [p, g] : vals)
+    {
+        if (g.bomb)
+            continue;
+        g.clue.type = RegionType::Type(r.get(5));
+        if (g.clue.type != RegionType::NONE)
+            g.clue.value = int8_t(r.get(value_bits));
+    }
+}
+
+// dup() copies the region containers as they are, leaving the copy's
+// multiset pointing into this grid's list. Only pending regions are allowed
+// here, which is the state add_base_regions leaves a fresh grid in.
+Grid* Grid::clone()
+{
+    assert(regions.empty() && regions_set.empty() && deleted_regions.empty() && cell_causes.empty());
+    Grid* grid = dup();
+    grid->regions_to_add_multiset.clear();
+    std::map<GridRegion*, GridRegion*> remap;
+    std::list<GridRegion>::iterator it = grid->regions_to_add.begin();
+    for (GridRegion& r : regions_to_add)
+        remap[&r] = &*it++;
+    for (GridRegion* r : regions_to_add_multiset)
+        grid->regions_to_add_multiset.insert(grid->regions_to_add_multiset.end(), remap[r]);
+    return grid;
+}
+
+std::string Grid::pack_level(const std::string& s)
+{
+    if (is_packed(s))
+        return s;
+    Grid* grid = Load(s);
+    std::string packed = grid->to_packed();
+    delete grid;
+    return packed;
+}
+
+std::string Grid::unpack_level(const std::string& s)
+{
+    if (!is_packed(s))
+        return s;
+    Grid* grid = Load(s);
+    std::string text = grid->to_string();
+    delete grid;
+    return text;
+}
+
 Grid* Grid::Load(std::string s)
 {
+    if (is_packed(s))
+    {
+        Grid* grid;
+        int a = uint8_t(s[0]) & 0x0F;
+        if (a == 0)
+            grid = new SquareGrid();
+        else if (a == 1)
+            grid = new TriangleGrid();
+        else if (a == 2)
+            grid = new HexagonGrid();
+        else
+            throw(std::runtime_error("Bad packed level"));
+        grid->from_packed(s);
+        return grid;
+    }
     assert(s.length() >= 3);
     int a = s[0] - 'A';
     if (a == 0)
@@ -2381,18 +2657,22 @@ void Grid::solve_easy()
         add_new_regions();
         if (regions.size() > 1000)
             return;
+        unsigned idx = 0;
         for (GridRule& rule : global_rules)
         {
             if (rule.apply_region_type.type == RegionType::VISIBILITY)
             {
-                apply_rule(rule, NULL);
+                apply_rule(rule, NULL, rule_profile(idx, &rule));
             }
+            idx++;
         }
+        idx = 0;
         for (GridRule& rule : global_rules)
         {
+            RuleProfile& prof = rule_profile(idx++, &rule);
             if (rule.apply_region_type.type == RegionType::VISIBILITY)
                 continue;
-            while (apply_rule(rule, NULL) != APPLY_RULE_RESP_NONE)
+            while (apply_rule(rule, NULL, prof) != APPLY_RULE_RESP_NONE)
                 rep = true;
         }
         // for (GridRegion& r : regions)
@@ -3984,7 +4264,7 @@ static bool are_connected(GridRegion* r0, GridRegion* r1, GridRegion* r2, GridRe
     return false;
 }
 
-Grid::ApplyRuleResp Grid::apply_rule(GridRule& rule, GridRegion* unstale_region, bool update_stats)
+Grid::ApplyRuleResp Grid::apply_rule(GridRule& rule, GridRegion* unstale_region, RuleProfile& prof, bool update_stats)
 {
     if (rule.deleted)
         return APPLY_RULE_RESP_NONE;
@@ -4004,7 +4284,10 @@ Grid::ApplyRuleResp Grid::apply_rule(GridRule& rule, GridRegion* unstale_region,
                 places_for_reg |= 1 << i;
         }
         if (!places_for_reg)
+        {
+            prof.invocations++;
             return APPLY_RULE_RESP_NONE;
+        }
     }
     else
         places_for_reg = 0x1;
@@ -4045,6 +4328,7 @@ Grid::ApplyRuleResp Grid::apply_rule(GridRule& rule, GridRegion* unstale_region,
     int var_counts[32];
     for (int i = 0; i < 32; i++)
         var_counts[i] = -1;
+    prof.invocations++;
 
     for (int nonstale_rep_index = 0; nonstale_rep_index < rule.region_count; nonstale_rep_index++)
     {
@@ -4053,27 +4337,43 @@ Grid::ApplyRuleResp Grid::apply_rule(GridRule& rule, GridRegion* unstale_region,
             std::vector<GridRegion*>& set0 = (unstale_region && (nonstale_rep_index == 0)) ? unstale_regions : pos_regions[0];
             for (GridRegion* r0 : set0)
             {
+                prof.candidates++;
                 if (!rule.jit_matches(fast_ops.ops[0], (rule.region_count == 1), r0, NULL, NULL, NULL, var_counts))
+                {
+                    prof.rejected[0]++;
                     continue;
+                }
                 std::vector<GridRegion*>& set1 = (nonstale_rep_index == 1) ? unstale_regions : pos_regions[1];
                 for (GridRegion* r1 : set1)
                 {
                     if (r0 == r1) continue;
+                    prof.candidates++;
                     if (!rule.jit_matches(fast_ops.ops[1], (rule.region_count == 2), r0, r1, NULL, NULL, var_counts))
+                    {
+                        prof.rejected[1]++;
                         continue;
+                    }
                     std::vector<GridRegion*>& set2 = (nonstale_rep_index == 2) ? unstale_regions : pos_regions[2];
                     for (GridRegion* r2 : set2)
                     {
                         if (r2 && ((r0 == r2) || (r1 == r2))) continue;
+                        prof.candidates++;
                         if (!rule.jit_matches(fast_ops.ops[2], (rule.region_count == 3), r0, r1, r2, NULL, var_counts))
+                        {
+                            prof.rejected[2]++;
                             continue;
+                        }
                         std::vector<GridRegion*>& set3 = (nonstale_rep_index == 3) ? unstale_regions : pos_regions[3];
                         for (GridRegion* r3 : set3)
                         {
                             if (r3 && ((r0 == r3) || (r1 == r3) || (r2 == r3))) continue;
+                            prof.candidates++;
                             bool m = rule.jit_matches(fast_ops.ops[3], (rule.region_count == 4), r0, r1, r2, r3, var_counts);
                             if (!m)
+                            {
+                                prof.rejected[3]++;
                                 continue;
+                            }
                             // int var_counts2[32];
                             // for (int i = 0; i < 32; i++)
                             //     var_counts2[i] = -1;
@@ -4100,6 +4400,8 @@ Grid::ApplyRuleResp Grid::apply_rule(GridRule& rule, GridRegion* unstale_region,
                                 if (!are_connected(r0, r1, r2, r3)) continue;
                                 GridRegion* regions[4] = {r0, r1, r2, r3};
                                 ApplyRuleResp resp = apply_rule(rule, regions, var_counts, update_stats);
+                                if (resp != APPLY_RULE_RESP_NONE)
+                                    prof.hits++;
                                 if ((resp != APPLY_RULE_RESP_NONE) && (rule.apply_region_type.type == RegionType::SET))
                                     return resp;
                                 if (resp == APPLY_RULE_RESP_HIT)
@@ -4244,12 +4546,35 @@ void Grid::clear_regions()
     wants_base_regions = true;
 }
 
+RuleProfile& Grid::rule_profile_slot(unsigned index, GridRule* rule)
+{
+    if (index >= rule_profiles.size())
+        rule_profiles.resize(index + 1, std::make_pair((GridRule*)NULL, RuleProfile()));
+    auto& [old_rule, prof] = rule_profiles[index];
+    if (old_rule)
+        level_profile[old_rule].add(prof);
+    old_rule = rule;
+    prof = RuleProfile();
+    return prof;
+}
+
+void Grid::flush_rule_profiles()
+{
+    for (auto& [rule, prof] : rule_profiles)
+        if (rule)
+            level_profile[rule].add(prof);
+    rule_profiles.clear();
+}
+
 void Grid::commit_level_counts()
 {
+    flush_rule_profiles();
     for (auto [rule, count] : level_used_count)
         rule->used_count += count;
     for (auto [rule, count] : level_clear_count)
         rule->clear_count += count;
+    for (auto& [rule, prof] : level_profile)
+        rule->profile.add(prof);
 }
 
 void Grid::remove_from_regions_to_add_for_rule(GridRule* rule)
@@ -4279,6 +4604,139 @@ bool Grid::uses_neg_bombs()
     return false;
 }
 
+static uint64_t get_time_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int advance_grid(Grid* grid, std::list<GridRule>& rules, GridRegion* inspected_region, const XYSet& filter_pos_and, const XYSet& filter_pos_not, bool skip_hide)
+{
+    grid->add_base_regions();
+    // for (GridRegion& r : grid->regions)
+    //     r.stale = true;
+    
+    GridRegion* new_region = grid->add_one_new_region(inspected_region, filter_pos_and, filter_pos_not);
+
+    if (!new_region)
+        return 0;
+
+    if (!new_region->stale)
+    {
+        for (int i = 1; i < 3; i++)
+        {
+            int idx = -1;
+            for (GridRule& rule : rules)
+            {
+                idx++;
+                if (rule.deleted)
+                    continue;
+                if (rule.paused)
+                    continue;
+                if (rule.apply_region_type.type == RegionType::VISIBILITY && rule.apply_region_type.value == i)
+                {
+                    if (skip_hide && rule.apply_region_type.value == 1)
+                        continue;
+                    RuleProfile& prof = grid->rule_profile(idx, &rule);
+                    uint64_t oldtime = get_time_ns();
+                    Grid::ApplyRuleResp resp  = grid->apply_rule(rule, new_region, prof);
+                    uint64_t newtime = get_time_ns();
+                    prof.ns += newtime - oldtime;
+                    if (resp == Grid::APPLY_RULE_RESP_HIT)
+                        break;
+                }
+            }
+        }
+        return 2;
+    }
+
+    if (new_region->vis_level != GRID_VIS_LEVEL_BIN)
+    {
+        int idx = -1;
+        for (GridRule& rule : rules)
+        {
+            idx++;
+            if (rule.paused)
+                continue;
+            if (rule.deleted)
+                continue;
+            if (rule.apply_region_type.type == RegionType::VISIBILITY)
+                continue;
+            if (rule.apply_region_type.type == RegionType::SET)
+                continue;
+            {
+                RuleProfile& prof = grid->rule_profile(idx, &rule);
+                uint64_t oldtime = get_time_ns();
+                grid->apply_rule(rule, new_region, prof);
+                uint64_t newtime = get_time_ns();
+                prof.ns += newtime - oldtime;
+            }
+        }
+    }
+
+    if (!new_region->deleted)
+    {
+        int idx = -1;
+        for (GridRule& rule : rules)
+        {
+            idx++;
+            if (rule.deleted)
+                continue;
+            if (rule.paused)
+                continue;
+            if (rule.apply_region_type.type != RegionType::SET)
+                continue;
+            RuleProfile& prof = grid->rule_profile(idx, &rule);
+            uint64_t oldtime = get_time_ns();
+            Grid::ApplyRuleResp resp  = grid->apply_rule(rule, new_region, prof);
+            uint64_t newtime = get_time_ns();
+            prof.ns += newtime - oldtime;
+            if (resp == Grid::APPLY_RULE_RESP_HIT)
+            {
+                new_region->stale = false;
+                for (GridRegion& r : grid->regions)
+                {
+                    if (r.vis_cause.rule && (
+                        (r.vis_cause.regions[0] && r.vis_cause.regions[0]->deleted) ||
+                        (r.vis_cause.regions[1] && r.vis_cause.regions[1]->deleted) ||
+                        (r.vis_cause.regions[2] && r.vis_cause.regions[2]->deleted) ||
+                        (r.vis_cause.regions[3] && r.vis_cause.regions[3]->deleted) ))
+                    {
+                        r.vis_cause = GridRegionCause();
+                        GridVisLevel prev = r.vis_level;
+                        r.vis_level = GRID_VIS_LEVEL_SHOW;
+                        for (int i = 1; i < 3; i++)
+                        {
+                            int vis_idx = -1;
+                            for (GridRule& rule : rules)
+                            {
+                                vis_idx++;
+                                if (rule.deleted)
+                                    continue;
+                                if (rule.paused)
+                                    continue;
+                                if (rule.apply_region_type.type == RegionType::VISIBILITY && rule.apply_region_type.value == i)
+                                {
+                                    if (skip_hide && rule.apply_region_type.value == 1)
+                                        continue;
+                                    RuleProfile& vis_prof = grid->rule_profile(vis_idx, &rule);
+                                    uint64_t oldtime = get_time_ns();
+                                    grid->apply_rule(rule, &r, vis_prof, false);
+                                    uint64_t newtime = get_time_ns();
+                                    vis_prof.ns += newtime - oldtime;
+                                }
+                            }
+                        }
+                        if ((r.vis_level != prev) && (prev == GRID_VIS_LEVEL_BIN))
+                            r.stale = false;
+                    }
+                }
+                return 1;
+            }
+        }
+    }
+    return 2;
+}
+
 std::string SquareGrid::text_desciption()
 {
     return "Square " + std::to_string(size.x) + "x" + std::to_string(size.y) + ((wrapped == WRAPPED_NOT) ? "" : ((wrapped == WRAPPED_SIDE) ? " Plane" : " Recursed"));
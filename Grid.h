@@ -7,6 +7,7 @@
 #include <list>
 #include <bitset>
 #include <array>
+#include <vector>
 
 extern bool SHUTDOWN;
 
@@ -228,6 +229,31 @@ public:
     }
 };
 
+// Per rule solver statistics. candidates counts every partial region
+// tuple handed to jit_matches and rejected[n] those turned away at stage n.
+class RuleProfile
+{
+public:
+    uint64_t invocations = 0;
+    uint64_t candidates = 0;
+    uint64_t rejected[4] = {};
+    uint64_t hits = 0;
+    uint64_t ns = 0;
+
+    void add(const RuleProfile& other)
+    {
+        invocations += other.invocations;
+        candidates += other.candidates;
+        for (int i = 0; i < 4; i++)
+            rejected[i] += other.rejected[i];
+        hits += other.hits;
+        ns += other.ns;
+    }
+    unsigned cpu_ms() const { return ns / 1000000; }
+    void load(SaveObject* sob);
+    SaveObject* save();
+};
+
 class GridRule
 {
 public:
@@ -246,7 +272,7 @@ public:
     unsigned used_count = 0;
     unsigned clear_count = 0;
     uint8_t sort_perm = 0;
-    unsigned cpu_time = 0;
+    RuleProfile profile;
     std::string comment;
 
 
@@ -359,6 +385,11 @@ public:
     XYSet last_cleared_regions;
     std::map<GridRule*, int> level_used_count;
     std::map<GridRule*, int> level_clear_count;
+    std::map<GridRule*, RuleProfile> level_profile;
+    // Profiles the solver is still filling in, by the rule's position in
+    // the list it is running, so a call costs a pointer compare rather than
+    // a map lookup. flush_rule_profiles() folds them into level_profile.
+    std::vector<std::pair<GridRule*, RuleProfile>> rule_profiles;
 
 protected:
     Grid();
@@ -367,12 +398,19 @@ public:
     virtual ~Grid(){};
     void randomize(XYPos size_, WrapType wrapped, int merged_count, int row_percent, int negated_percent);
     void from_string(std::string s);
+    void from_packed(const std::string& s);
+    std::string to_packed();
 
     static Grid* Load(std::string s);
+    Grid* clone();
+    static bool is_packed(const std::string& s) {return !s.empty() && (uint8_t(s[0]) & 0xF0) == 0xF0;}
+    static std::string pack_level(const std::string& s);
+    static std::string unpack_level(const std::string& s);
     GridPlace get(XYPos p);
     RegionType& get_clue(XYPos p);
 
     virtual std::string text_desciption() = 0;
+    virtual int shape() = 0;
     virtual std::string to_string();
     virtual Grid* dup() = 0;
     virtual XYSet get_squares() = 0;
@@ -414,7 +452,7 @@ public:
     };
 
     ApplyRuleResp apply_rule(GridRule& rule, GridRegion* regions[4], int var_counts[32], bool update_stats = true);
-    ApplyRuleResp apply_rule(GridRule& rule, GridRegion* region, bool update_stats = true);
+    ApplyRuleResp apply_rule(GridRule& rule, GridRegion* region, RuleProfile& prof, bool update_stats = true);
 //    ApplyRuleResp apply_rule(GridRule& rule, bool force = false);
     void remove_from_regions_to_add_multiset(GridRegion*);
     void add_new_regions();
@@ -422,10 +460,20 @@ public:
     GridRegion* add_one_new_region(GridRegion* ancestor, const XYSet& filter_pos_and, const XYSet& filter_pos_not);
     void clear_regions();
     void commit_level_counts();
+    RuleProfile& rule_profile(unsigned index, GridRule* rule)
+    {
+        if (index < rule_profiles.size() && rule_profiles[index].first == rule)
+            return rule_profiles[index].second;
+        return rule_profile_slot(index, rule);
+    }
+    RuleProfile& rule_profile_slot(unsigned index, GridRule* rule);
+    void flush_rule_profiles();
     void remove_from_regions_to_add_for_rule(GridRule* rule);
     bool uses_neg_bombs();
 };
 
+int advance_grid(Grid* grid, std::list<GridRule>& rules, GridRegion* inspected_region, const XYSet& filter_pos_and, const XYSet& filter_pos_not, bool skip_hide = false);
+
 class LocalGrid
 {
 private:
@@ -446,6 +494,7 @@ public:
     SquareGrid(std::string s) {from_string(s);}
 
     std::string text_desciption();
+    int shape() {return 0;}
     std::string to_string();
     Grid* dup() {return new SquareGrid(*this);}
     XYSet get_squares();
@@ -477,6 +526,7 @@ public:
     bool is_inside(XYPos p);
 
     std::string text_desciption();
+    int shape() {return 1;}
     std::string to_string();
     Grid* dup() {return new TriangleGrid(*this);}
     XYSet get_squares();
@@ -511,6 +561,7 @@ public:
     HexagonGrid(std::string s) {from_string(s);}
 
     std::string text_desciption();
+    int shape() {return 2;}
     std::string to_string();
     Grid* dup() {return new HexagonGrid(*this);}
     XYSet get_squares();
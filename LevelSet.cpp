@@ -5,13 +5,132 @@
 #include <iostream>
 #include <fstream>
 #include <algorithm>
+#include <string.h>
 #ifdef _WIN32
     #include <filesystem>
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
 #endif
 
 std::vector<LevelSet*> global_level_sets[GLBAL_LEVEL_SETS];
 std::vector<LevelSet*> second_global_level_sets[GLBAL_LEVEL_SETS];
 
+// Level pack layout, all integers little endian:
+//   "BLVP", u32 version, u32 set count
+//   per set: u8 second, u8 group, u16 unused, u32 level count,
+//            u64 block offset, u32 compressed size, u32 raw size
+//   blocks: one zstd frame per set holding u32 offsets[level count + 1]
+//           followed by the levels, in Grid::to_packed form, back to back
+// Only the header and index are read at startup.
+
+static const char level_pack_magic[4] = {'B', 'L', 'V', 'P'};
+static const uint32_t level_pack_version = 1;
+static const unsigned level_pack_header_size = 12;
+static const unsigned level_pack_entry_size = 24;
+
+static uint32_t get_u32(const char* p)
+{
+    const uint8_t* u = (const uint8_t*)p;
+    return u[0] | (u[1] << 8) | (u[2] << 16) | (uint32_t(u[3]) << 24);
+}
+
+static uint64_t get_u64(const char* p)
+{
+    return get_u32(p) | (uint64_t(get_u32(p + 4)) << 32);
+}
+
+static void put_u32(std::string& out, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+        out.push_back(char(v >> (i * 8)));
+}
+
+static void put_u64(std::string& out, uint64_t v)
+{
+    put_u32(out, v);
+    put_u32(out, v >> 32);
+}
+
+// Read only mapping of levels.data, kept for as long as sets refer to it.
+class MappedFile
+{
+public:
+    const char* data = NULL;
+    size_t size = 0;
+
+    bool open(const char* filename)
+    {
+#ifdef _WIN32
+        file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(file, &file_size) || !file_size.QuadPart)
+        {
+            close();
+            return false;
+        }
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping)
+            data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!data)
+        {
+            close();
+            return false;
+        }
+        size = file_size.QuadPart;
+#else
+        int fd = ::open(filename, O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) || !st.st_size)
+        {
+            ::close(fd);
+            return false;
+        }
+        void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED)
+            return false;
+        data = (const char*)p;
+        size = st.st_size;
+#endif
+        return true;
+    }
+
+    void close()
+    {
+#ifdef _WIN32
+        if (data)
+            UnmapViewOfFile(data);
+        if (mapping)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+        mapping = NULL;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (data)
+            munmap((void*)data, size);
+#endif
+        data = NULL;
+        size = 0;
+    }
+
+private:
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+#endif
+};
+
+static MappedFile level_pack;
+
 LevelSet::LevelSet(SaveObjectMap* omap)
 {
     SaveObjectList* rlist = omap->get_item("levels")->get_list();
@@ -28,39 +147,131 @@ LevelSet::LevelSet(SaveObjectMap* omap)
     }
 }
 
-SaveObject* LevelSet::save()
+LevelSet::LevelSet(const char* block_, unsigned comp_size_, unsigned raw_size_, unsigned level_count_):
+    loaded(false),
+    block(block_),
+    comp_size(comp_size_),
+    raw_size(raw_size_),
+    level_count(level_count_)
 {
-    SaveObjectMap* omap = new SaveObjectMap;
+}
 
-    SaveObjectList* rlist = new SaveObjectList;
-    for (const std::string& level : levels)
+std::vector<std::string>& LevelSet::get_levels()
+{
+    if (!loaded.load(std::memory_order_acquire))
     {
-        rlist->add_string(level);
+        std::lock_guard<std::mutex> guard(load_mutex);
+        if (!loaded.load(std::memory_order_relaxed))
+        {
+            decode();
+            loaded.store(true, std::memory_order_release);
+        }
     }
-    omap->add_item("levels", rlist);
+    return levels;
+}
 
-    return omap;
+// Decompresses the block into raw and checks its offset table, so decode()
+// cannot fail once the pack has been accepted.
+bool LevelSet::unpack(std::string& raw)
+{
+    raw.resize(raw_size);
+    try
+    {
+        if (decompress_zstd_into(block, comp_size, raw.data(), raw.size()) != raw_size)
+            return false;
+    }
+    catch (const std::runtime_error& error)
+    {
+        return false;
+    }
+    size_t table_size = (size_t(level_count) + 1) * 4;
+    if (table_size > raw_size)
+        return false;
+    for (unsigned i = 0; i < level_count; i++)
+    {
+        uint32_t start = get_u32(&raw[i * 4]);
+        uint32_t end = get_u32(&raw[i * 4 + 4]);
+        if (start > end || end > raw_size - table_size)
+            return false;
+    }
+    return true;
+}
+
+void LevelSet::decode()
+{
+    std::string raw;
+    if (!unpack(raw))
+        throw(std::runtime_error("Bad level pack block"));
+    size_t table_size = (size_t(level_count) + 1) * 4;
+    levels.reserve(level_count);
+    for (unsigned i = 0; i < level_count; i++)
+    {
+        uint32_t start = get_u32(&raw[i * 4]);
+        uint32_t end = get_u32(&raw[i * 4 + 4]);
+        levels.emplace_back(raw.data() + table_size + start, end - start);
+    }
+}
+
+static bool load_level_pack()
+{
+    if (!level_pack.open("levels.data"))
+        return false;
+    const char* data = level_pack.data;
+    size_t size = level_pack.size;
+    if (size < level_pack_header_size || memcmp(data, level_pack_magic, 4) || get_u32(data + 4) != level_pack_version)
+    {
+        level_pack.close();
+        return false;
+    }
+    uint32_t set_count = get_u32(data + 8);
+    if (set_count > (size - level_pack_header_size) / level_pack_entry_size)
+        throw(std::runtime_error("Bad level pack index"));
+    // Every block is checked here, where a bad file can be reported, rather
+    // than on first use by a robot thread or the renderer.
+    std::string scratch;
+    for (uint32_t i = 0; i < set_count; i++)
+    {
+        const char* entry = data + level_pack_header_size + i * level_pack_entry_size;
+        bool second = entry[0];
+        unsigned group = uint8_t(entry[1]);
+        uint32_t level_count = get_u32(entry + 4);
+        uint64_t offset = get_u64(entry + 8);
+        uint32_t comp_size = get_u32(entry + 16);
+        uint32_t raw_size = get_u32(entry + 20);
+        if (offset > size || comp_size > size - offset)
+            throw(std::runtime_error("Bad level pack index"));
+        if (group >= GLBAL_LEVEL_SETS)
+            continue;
+        LevelSet* lset = new LevelSet(data + offset, comp_size, raw_size, level_count);
+        if (!lset->unpack(scratch))
+        {
+            delete lset;
+            throw(std::runtime_error("Bad level pack block"));
+        }
+        (second ? second_global_level_sets : global_level_sets)[group].push_back(lset);
+    }
+    return true;
 }
 
 void LevelSet::init_global()
 {
     if (!global_level_sets[0].empty())
         return;
+    delete_global();
+    if (load_level_pack())
+        return;
 
+    // Older levels.data files hold one compressed SaveObject tree.
 #ifdef _WIN32
         std::ifstream loadfile(std::filesystem::path((char8_t*)"levels.data"), std::ios::binary);
 #else
         std::ifstream loadfile("levels.data");
 #endif
 
-    std::stringstream str_stream;
-    str_stream << loadfile.rdbuf();
-    std::string str = decompress_string(str_stream.str());
-
-    SaveObjectMap* omap = SaveObject::load(str)->get_map();
+    DecompressIStream zloadfile(loadfile);
+    SaveObjectMap* omap = SaveObject::load(zloadfile)->get_map();
     SaveObjectList* llist = omap->get_item("level_sets")->get_list();
     SaveObjectList* sllist = omap->get_item("second_level_sets")->get_list();
-    delete_global();
 
     for (unsigned j = 0; (j < llist->get_count()) && (j < GLBAL_LEVEL_SETS); j++)
     {
@@ -81,14 +292,8 @@ void LevelSet::init_global()
         }
     }
     delete omap;
-
-
-
-
-
-
-
 }
+
 void LevelSet::delete_global()
 {
     for (int i = 0; i < GLBAL_LEVEL_SETS; i++)
@@ -104,44 +309,71 @@ void LevelSet::delete_global()
         }
         second_global_level_sets[i].clear();
     }
+    level_pack.close();
 }
 
 void LevelSet::save_global()
 {
-    SaveObjectMap* omap = new SaveObjectMap;
-    SaveObjectList* llist = new SaveObjectList;
-
-    for (int i = 0; i < GLBAL_LEVEL_SETS; i++)
+    std::string index;
+    std::string blocks;
+    uint32_t set_count = 0;
+    for (int second = 0; second < 2; second++)
     {
-        SaveObjectList* rlist = new SaveObjectList;
-        for (LevelSet* level_set : global_level_sets[i])
+        for (int i = 0; i < GLBAL_LEVEL_SETS; i++)
         {
-            rlist->add_item(level_set->save());
+            for (LevelSet* level_set : (second ? second_global_level_sets : global_level_sets)[i])
+            {
+                std::vector<std::string> levels;
+                for (const std::string& level : level_set->get_levels())
+                    if (level != "")
+                        levels.push_back(Grid::pack_level(level));
+                std::string raw;
+                uint32_t pos = 0;
+                for (const std::string& level : levels)
+                {
+                    put_u32(raw, pos);
+                    pos += level.size();
+                }
+                put_u32(raw, pos);
+                for (const std::string& level : levels)
+                    raw += level;
+
+                std::string comp;
+                comp.resize(compress_bound(raw.size()));
+                comp.resize(compress_zstd_into(raw.data(), raw.size(), comp.data(), comp.size(), compress_profile_level(COMPRESS_ARCHIVE)));
+
+                index.push_back(char(second));
+                index.push_back(char(i));
+                index.append(2, 0);
+                put_u32(index, levels.size());
+                put_u64(index, blocks.size());
+                put_u32(index, comp.size());
+                put_u32(index, raw.size());
+                blocks += comp;
+                set_count++;
+            }
         }
-        llist->add_item(rlist);
     }
-    omap->add_item("level_sets", llist);
 
-    llist = new SaveObjectList;
-    for (int i = 0; i < GLBAL_LEVEL_SETS; i++)
+    std::string header(level_pack_magic, 4);
+    put_u32(header, level_pack_version);
+    put_u32(header, set_count);
+    uint64_t blocks_offset = header.size() + index.size();
+    for (uint32_t i = 0; i < set_count; i++)
     {
-        SaveObjectList* rlist = new SaveObjectList;
-        for (LevelSet* level_set : second_global_level_sets[i])
-        {
-            rlist->add_item(level_set->save());
-        }
-        llist->add_item(rlist);
+        std::string offset;
+        put_u64(offset, get_u64(&index[i * level_pack_entry_size + 8]) + blocks_offset);
+        index.replace(i * level_pack_entry_size + 8, 8, offset);
     }
-    omap->add_item("second_level_sets", llist);
 
+    // Every set is resident now, so the old mapping can go before the file
+    // underneath it is replaced.
+    level_pack.close();
 
 #ifdef _WIN32
             std::ofstream outfile (std::filesystem::path((char8_t*)"levels.data"), std::ios::binary);
 #else
-            std::ofstream outfile ("levels.data");
+            std::ofstream outfile ("levels.data", std::ios::binary);
 #endif
-   
-    std::string out_data = compress_string_zstd(omap->to_string(), 1);
-    outfile << out_data;
-    delete omap;
+    outfile << header << index << blocks;
 }
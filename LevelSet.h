@@ -2,21 +2,40 @@
 #include "Misc.h"
 #include "SaveState.h"
 #include <vector>
+#include <mutex>
+#include <atomic>
 
 #define GLBAL_LEVEL_SETS 4
 
+// A set of levels. Sets loaded from a level pack only know their size until
+// a level is asked for, at which point the whole set is decompressed from
+// the mapped file.
 class LevelSet
 {
 public:
-    std::vector<std::string> levels;
-
     LevelSet(){};
     LevelSet(SaveObjectMap* omap);
-    SaveObject* save();
+    LevelSet(const char* block, unsigned comp_size, unsigned raw_size, unsigned level_count);
+
+    unsigned size() {return loaded ? levels.size() : level_count;}
+    const std::string& get(unsigned index) {return get_levels()[index];}
+    std::vector<std::string>& get_levels();
 
     static void init_global();
     static void save_global();
     static void delete_global();
+    bool unpack(std::string& raw);
+
+private:
+    void decode();
+
+    std::vector<std::string> levels;
+    std::atomic<bool> loaded = true;
+    std::mutex load_mutex;
+    const char* block = NULL;
+    unsigned comp_size = 0;
+    unsigned raw_size = 0;
+    unsigned level_count = 0;
 };
 
 extern std::vector<LevelSet*> global_level_sets[GLBAL_LEVEL_SETS];
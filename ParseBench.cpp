@@ -0,0 +1,142 @@
+#include "SaveState.h"
+#include "Compress.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+
+// Compares the buffer parser behind SaveObject::load against the original
+// character stream parser on real files, and against loading the same tree
+// from the binary encoding. Compressed inputs are decompressed first.
+//
+//  ParseBench [-o out.json] [file ...]
+
+static uint64_t get_time_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static std::string load_payload(std::string filename)
+{
+    std::ifstream loadfile(filename, std::ios::binary);
+    if (loadfile.fail())
+        throw(std::runtime_error("Could not open " + filename));
+    std::stringstream str_stream;
+    if (is_zstd_stream(loadfile))
+    {
+        DecompressIStream zloadfile(loadfile);
+        str_stream << zloadfile.rdbuf();
+    }
+    else
+        str_stream << loadfile.rdbuf();
+    return str_stream.str();
+}
+
+static uint64_t time_stream_parse(const std::string& payload)
+{
+    unsigned reps = 0;
+    uint64_t start = get_time_ns();
+    uint64_t now;
+    do
+    {
+        std::istringstream stream(payload);
+        delete SaveObject::parse_stream(stream);
+        reps++;
+        now = get_time_ns();
+    } while (now - start < 200000000);
+    return (now - start) / reps;
+}
+
+static uint64_t time_buffer_parse(const std::string& payload)
+{
+    unsigned reps = 0;
+    uint64_t start = get_time_ns();
+    uint64_t now;
+    do
+    {
+        delete SaveObject::load(payload.data(), payload.size());
+        reps++;
+        now = get_time_ns();
+    } while (now - start < 200000000);
+    return (now - start) / reps;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* out_filename = NULL;
+    std::vector<std::string> filenames;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-o") && i + 1 < argc)
+            out_filename = argv[++i];
+        else
+            filenames.push_back(argv[i]);
+    }
+    if (filenames.empty())
+        filenames.push_back("lang.json");
+
+    SaveObjectMap* omap = new SaveObjectMap;
+    SaveObjectList* file_list = new SaveObjectList;
+    for (std::string& filename : filenames)
+    {
+        std::string payload;
+        std::string json;
+        std::string binary;
+        try
+        {
+            payload = load_payload(filename);
+            SaveObject* b = SaveObject::load(payload.data(), payload.size());
+            binary = b->to_binary();
+            json = b->to_string();
+            delete b;
+            std::istringstream stream(json);
+            SaveObject* a = SaveObject::parse_stream(stream);
+            SaveObject* c = SaveObject::load(binary);
+            bool same = (a->to_string() == json) && (c->to_string() == json);
+            delete a;
+            delete c;
+            if (!same)
+                throw(std::runtime_error("Parsers disagree on " + filename));
+        }
+        catch (const std::runtime_error& error)
+        {
+            std::cerr << error.what() << "\n";
+            continue;
+        }
+        uint64_t stream_ns = time_stream_parse(json);
+        uint64_t buffer_ns = time_buffer_parse(json);
+        uint64_t binary_ns = time_buffer_parse(binary);
+        SaveObjectMap* fmap = new SaveObjectMap;
+        fmap->add_string("name", filename);
+        fmap->add_num("size", json.size());
+        fmap->add_num("binary_size", binary.size());
+        fmap->add_num("compressed_size", compress_string(json, COMPRESS_ARCHIVE).size());
+        fmap->add_num("binary_compressed_size", compress_string(binary, COMPRESS_ARCHIVE).size());
+        fmap->add_num("stream_ns", stream_ns);
+        fmap->add_num("buffer_ns", buffer_ns);
+        fmap->add_num("binary_ns", binary_ns);
+        fmap->add_num("stream_mb_per_sec", stream_ns ? json.size() * 1000 / stream_ns : 0);
+        fmap->add_num("buffer_mb_per_sec", buffer_ns ? json.size() * 1000 / buffer_ns : 0);
+        file_list->add_item(fmap);
+    }
+    omap->add_item("files", file_list);
+
+    if (out_filename)
+    {
+        std::ofstream outfile(out_filename);
+        omap->pretty_print(outfile);
+        outfile << "\n";
+    }
+    else
+    {
+        omap->pretty_print(std::cout);
+        std::cout << "\n";
+    }
+    delete omap;
+    return 0;
+}
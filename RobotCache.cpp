@@ -0,0 +1,275 @@
+#include "RobotCache.h"
+#include "SaveState.h"
+#include "Compress.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <algorithm>
+
+static uint64_t fnv_hash(uint64_t hash, uint64_t value)
+{
+    for (int i = 0; i < 8; i++)
+    {
+        hash ^= (value >> (i * 8)) & 0xFF;
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+uint64_t RobotCache::rule_fingerprint(GridRule& rule)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    hash = fnv_hash(hash, rule.priority);
+    hash = fnv_hash(hash, rule.region_count);
+    hash = fnv_hash(hash, rule.neg_reg_count);
+    for (int i = 0; i < 4; i++)
+        hash = fnv_hash(hash, rule.region_type[i].as_int());
+    for (int i = 0; i < 16; i++)
+        hash = fnv_hash(hash, rule.square_counts[i].as_int());
+    hash = fnv_hash(hash, rule.apply_region_type.as_int());
+    hash = fnv_hash(hash, rule.apply_region_bitmap);
+    hash = fnv_hash(hash, rule.neg_apply_region_bitmap);
+    return hash;
+}
+
+uint64_t RobotCache::level_hash(const std::string& level)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (char c : level)
+    {
+        hash ^= uint8_t(c);
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+int RobotCache::add_rule_set(std::vector<uint64_t> fingerprints)
+{
+    std::sort(fingerprints.begin(), fingerprints.end());
+    std::lock_guard<std::mutex> guard(mutex);
+    auto it = rule_set_index.find(fingerprints);
+    if (it != rule_set_index.end())
+        return it->second;
+    int index = rule_sets.size();
+    rule_sets.push_back(fingerprints);
+    rule_set_index[fingerprints] = index;
+    return index;
+}
+
+// Could the rule find a region for each of its slots amongst the types seen?
+static bool rule_could_match(GridRule& rule, std::vector<unsigned>& types)
+{
+    for (int i = 0; i < rule.region_count; i++)
+    {
+        RegionType want = rule.region_type[i];
+        bool want_neg = (i < rule.neg_reg_count);
+        bool found = false;
+        for (unsigned t : types)
+        {
+            if (bool(t >> 24) != want_neg)
+                continue;
+            RegionType type('a', t & 0xFFFFFF);
+            if (type == want || want.type == RegionType::NONE || (want.var && (type.type == want.type)))
+            {
+                found = true;
+                break;
+            }
+        }
+        if (!found)
+            return false;
+    }
+    return true;
+}
+
+bool RobotCache::lookup(int game_mode, const std::string& level, int rule_set, std::map<uint64_t, GridRule*>& rules, int rule_limit, int& regions)
+{
+    std::lock_guard<std::mutex> guard(mutex);
+    auto it = entries.find(std::make_pair(game_mode, level_hash(level)));
+    if (it == entries.end())
+        return false;
+    Entry& entry = it->second;
+    if (rule_limit >= 0 && entry.regions > rule_limit)
+        return false;
+    if (entry.rule_set != rule_set)
+    {
+        std::vector<uint64_t>& old_set = rule_sets[entry.rule_set];
+        for (uint64_t fp : entry.used)
+        {
+            if (!rules.count(fp))
+                return false;
+        }
+        for (auto& [fp, rule] : rules)
+        {
+            if (std::binary_search(old_set.begin(), old_set.end(), fp))
+                continue;
+            if (rule_could_match(*rule, entry.types))
+                return false;
+        }
+    }
+    regions = entry.regions;
+    return true;
+}
+
+void RobotCache::store(int game_mode, const std::string& level, int rule_set, Grid* grid, std::map<GridRule*, uint64_t>& fingerprints)
+{
+    Entry entry;
+    entry.rule_set = rule_set;
+    entry.regions = grid->regions.size();
+    for (auto [rule, count] : grid->level_used_count)
+        if (count)
+            entry.used.push_back(fingerprints[rule]);
+    for (auto [rule, count] : grid->level_clear_count)
+        if (count)
+            entry.used.push_back(fingerprints[rule]);
+    std::sort(entry.used.begin(), entry.used.end());
+    entry.used.erase(std::unique(entry.used.begin(), entry.used.end()), entry.used.end());
+
+    for (std::list<GridRegion>* list : {&grid->regions, &grid->deleted_regions})
+        for (GridRegion& r : *list)
+            entry.types.push_back(r.type.as_int() | (r.elements_neg.any() ? (1 << 24) : 0));
+    std::sort(entry.types.begin(), entry.types.end());
+    entry.types.erase(std::unique(entry.types.begin(), entry.types.end()), entry.types.end());
+
+    std::lock_guard<std::mutex> guard(mutex);
+    entries[std::make_pair(game_mode, level_hash(level))] = entry;
+}
+
+void RobotCache::load(std::string filename)
+{
+#ifdef _WIN32
+    std::ifstream loadfile(std::filesystem::path((char8_t*)filename.c_str()), std::ios::binary);
+#else
+    std::ifstream loadfile(filename.c_str());
+#endif
+    if (loadfile.fail())
+        return;
+    std::lock_guard<std::mutex> guard(mutex);
+    SaveObject* sob = NULL;
+    try
+    {
+        DecompressIStream zloadfile(loadfile);
+        sob = SaveObject::load(zloadfile);
+        SaveObjectMap* omap = sob->get_map();
+        if (omap->get_num("version") != 1)
+            throw(std::runtime_error("Unknown robot cache version"));
+        SaveObjectList* set_list = omap->get_item("rule_sets")->get_list();
+        for (unsigned i = 0; i < set_list->get_count(); i++)
+        {
+            SaveObjectList* fp_list = set_list->get_item(i)->get_list();
+            std::vector<uint64_t> fingerprints;
+            for (unsigned j = 0; j < fp_list->get_count(); j++)
+                fingerprints.push_back(fp_list->get_num(j));
+            rule_set_index[fingerprints] = rule_sets.size();
+            rule_sets.push_back(fingerprints);
+        }
+        SaveObjectList* level_list = omap->get_item("levels")->get_list();
+        for (unsigned i = 0; i < level_list->get_count(); i++)
+        {
+            SaveObjectMap* lmap = level_list->get_item(i)->get_map();
+            Entry entry;
+            entry.rule_set = lmap->get_num("rule_set");
+            entry.regions = lmap->get_num("regions");
+            if (entry.rule_set < 0 || entry.rule_set >= int(rule_sets.size()))
+                continue;
+            SaveObjectList* used_list = lmap->get_item("used")->get_list();
+            for (unsigned j = 0; j < used_list->get_count(); j++)
+                entry.used.push_back(used_list->get_num(j));
+            SaveObjectList* type_list = lmap->get_item("types")->get_list();
+            for (unsigned j = 0; j < type_list->get_count(); j++)
+                entry.types.push_back(type_list->get_num(j));
+            entries[std::make_pair(int(lmap->get_num("mode")), uint64_t(lmap->get_num("level")))] = entry;
+        }
+    }
+    catch (const std::runtime_error& error)
+    {
+        std::cerr << error.what() << "\n";
+        rule_sets.clear();
+        rule_set_index.clear();
+        entries.clear();
+    }
+    delete sob;
+}
+
+SaveObject* RobotCache::save()
+{
+    SaveObjectMap* omap = new SaveObjectMap;
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        std::map<int, int> remap;
+        for (auto& [key, entry] : entries)
+            remap[entry.rule_set] = 0;
+        SaveObjectList* set_list = new SaveObjectList;
+        for (auto& [old_index, new_index] : remap)
+        {
+            new_index = set_list->get_count();
+            SaveObjectList* fp_list = new SaveObjectList;
+            for (uint64_t fp : rule_sets[old_index])
+                fp_list->add_num(fp);
+            set_list->add_item(fp_list);
+        }
+        SaveObjectList* level_list = new SaveObjectList;
+        for (auto& [key, entry] : entries)
+        {
+            SaveObjectMap* lmap = new SaveObjectMap;
+            lmap->add_num("mode", key.first);
+            lmap->add_num("level", key.second);
+            lmap->add_num("rule_set", remap[entry.rule_set]);
+            lmap->add_num("regions", entry.regions);
+            SaveObjectList* used_list = new SaveObjectList;
+            for (uint64_t fp : entry.used)
+                used_list->add_num(fp);
+            lmap->add_item("used", used_list);
+            SaveObjectList* type_list = new SaveObjectList;
+            for (unsigned t : entry.types)
+                type_list->add_num(t);
+            lmap->add_item("types", type_list);
+            level_list->add_item(lmap);
+        }
+        omap->add_num("version", 1);
+        omap->add_item("rule_sets", set_list);
+        omap->add_item("levels", level_list);
+    }
+    return omap;
+}
+
+Grid* GridTemplateCache::get(const std::string& level)
+{
+    uint64_t hash = RobotCache::level_hash(level);
+    std::shared_ptr<Grid> tmpl;
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        auto it = entries.find(hash);
+        if (it != entries.end() && it->second.level == level)
+        {
+            lru.splice(lru.begin(), lru, it->second.lru);
+            tmpl = it->second.grid;
+        }
+    }
+    if (tmpl)
+        return tmpl->clone();
+
+    Grid* grid = Grid::Load(level);
+    grid->add_base_regions();
+    tmpl.reset(grid->clone());
+
+    std::lock_guard<std::mutex> guard(mutex);
+    auto [it, inserted] = entries.try_emplace(hash);
+    Entry& entry = it->second;
+    if (inserted)
+    {
+        lru.push_front(hash);
+        entry.lru = lru.begin();
+    }
+    else
+        lru.splice(lru.begin(), lru, entry.lru);
+    entry.level = level;
+    entry.grid = tmpl;
+    while (entries.size() > capacity)
+    {
+        entries.erase(lru.back());
+        lru.pop_back();
+    }
+    return grid;
+}
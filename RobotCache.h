@@ -0,0 +1,72 @@
+#pragma once
+#include "Grid.h"
+
+#include <mutex>
+#include <vector>
+#include <map>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <string>
+
+// Remembers levels the robots ran to completion without solving, so that a
+// restart after a rule change only re-runs the levels the change could
+// affect. Entries are keyed by level and game mode and record which rule set
+// produced them, which rules fired and which region types appeared. A result
+// stays valid as long as no rule that fired was removed and no added rule
+// could have matched the regions that were present.
+
+class RobotCache
+{
+public:
+    class Entry
+    {
+    public:
+        int rule_set = 0;
+        int regions = 0;
+        std::vector<uint64_t> used;
+        std::vector<unsigned> types;
+    };
+
+    static uint64_t rule_fingerprint(GridRule& rule);
+    static uint64_t level_hash(const std::string& level);
+
+    int add_rule_set(std::vector<uint64_t> fingerprints);
+    bool lookup(int game_mode, const std::string& level, int rule_set, std::map<uint64_t, GridRule*>& rules, int rule_limit, int& regions);
+    void store(int game_mode, const std::string& level, int rule_set, Grid* grid, std::map<GridRule*, uint64_t>& fingerprints);
+
+    void load(std::string filename);
+    SaveObject* save();
+
+private:
+    std::mutex mutex;
+    std::vector<std::vector<uint64_t>> rule_sets;
+    std::map<std::vector<uint64_t>, int> rule_set_index;
+    std::map<std::pair<int, uint64_t>, Entry> entries;
+};
+
+// Parsed levels with their base regions already added, shared by the robot
+// threads. Templates are never touched after they are stored; each robot
+// job gets its own clone. The least recently used templates are dropped
+// once there are more than capacity.
+
+class GridTemplateCache
+{
+public:
+    GridTemplateCache(unsigned capacity_ = 4096) : capacity(capacity_) {}
+    Grid* get(const std::string& level);
+
+private:
+    class Entry
+    {
+    public:
+        std::string level;
+        std::shared_ptr<Grid> grid;
+        std::list<uint64_t>::iterator lru;
+    };
+
+    std::mutex mutex;
+    std::unordered_map<uint64_t, Entry> entries;
+    std::list<uint64_t> lru;
+    unsigned capacity;
+};
@@ -1,6 +1,14 @@
 #include "Misc.h"
 #include "SaveState.h"
 #include <assert.h>
+#include <algorithm>
+#include <stdlib.h>
+#include <string_view>
+#include <unordered_map>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #define assert_exp(x) do { if (f.get() != x) throw (std::runtime_error("Unexpected character"));} while (false)
 
 static void skip_whitespace(std::istream& f)
@@ -19,6 +27,109 @@ static void skip_whitespace(std::istream& f)
     }
 }
 
+static thread_local SaveArena* current_arena = NULL;
+
+SaveArena::SaveArena(size_t block_size_):
+    block_size(block_size_)
+{
+}
+
+SaveArena::~SaveArena()
+{
+    while (blocks)
+    {
+        Block* next = blocks->next;
+        free(blocks);
+        blocks = next;
+    }
+}
+
+void* SaveArena::do_allocate(size_t bytes, size_t alignment)
+{
+    char* p = (char*)((uintptr_t(pos) + alignment - 1) & ~uintptr_t(alignment - 1));
+    if (!pos || p + bytes > end)
+    {
+        size_t size = std::max(block_size, bytes + alignment + sizeof(Block));
+        Block* block = (Block*)malloc(size);
+        if (!block)
+            throw std::bad_alloc();
+        block->next = blocks;
+        blocks = block;
+        pos = (char*)(block + 1);
+        end = (char*)block + size;
+        block_size *= 2;
+        p = (char*)((uintptr_t(pos) + alignment - 1) & ~uintptr_t(alignment - 1));
+    }
+    pos = p + bytes;
+    total_used += bytes;
+    return p;
+}
+
+std::pmr::memory_resource* SaveArena::resource()
+{
+    if (current_arena)
+        return current_arena;
+    return std::pmr::new_delete_resource();
+}
+
+SaveArena* SaveArena::current()
+{
+    return current_arena;
+}
+
+SaveArena::Scope::Scope(size_t size_hint)
+{
+    arena = new SaveArena(size_hint);
+    prev = current_arena;
+    current_arena = arena;
+}
+
+SaveArena::Scope::~Scope()
+{
+    current_arena = prev;
+    if (!finished)
+        delete arena;
+}
+
+// Every node carries a small header saying where it came from.
+struct SaveObjectHeader
+{
+    SaveArena* arena;
+    SaveArena* owned;
+};
+static_assert(sizeof(SaveObjectHeader) == 16);
+
+void SaveArena::Scope::adopt(SaveObject* root)
+{
+    SaveObjectHeader* header = (SaveObjectHeader*)root - 1;
+    assert(header->arena == arena);
+    header->owned = arena;
+    finished = true;
+}
+
+void* SaveObject::operator new(size_t size)
+{
+    SaveObjectHeader* header;
+    if (current_arena)
+        header = (SaveObjectHeader*)current_arena->allocate(sizeof(SaveObjectHeader) + size, 16);
+    else
+        header = (SaveObjectHeader*)::operator new(sizeof(SaveObjectHeader) + size);
+    header->arena = current_arena;
+    header->owned = NULL;
+    return header + 1;
+}
+
+void SaveObject::operator delete(void* ptr)
+{
+    if (!ptr)
+        return;
+    SaveObjectHeader* header = (SaveObjectHeader*)ptr - 1;
+    if (!header->arena)
+        ::operator delete(header);
+    else if (header->owned)
+        delete header->owned;
+}
+
 std::string SaveObject::to_string()
 {
     std::ostringstream stream;
@@ -27,11 +138,528 @@ std::string SaveObject::to_string()
 }
 SaveObject* SaveObject::load(std::string& input)
 {
-    std::istringstream stream(input);
-    return SaveObject::load(stream);
+    return SaveObject::load(input.data(), input.size());
+}
+
+std::string read_stream(std::istream& f)
+{
+    size_t size = 1 << 16;
+    std::streampos pos = f.tellg();
+    if (pos != std::streampos(-1) && f.seekg(0, std::ios::end))
+    {
+        size = size_t(f.tellg() - pos) + 1;
+        f.seekg(pos);
+    }
+    f.clear();
+    std::string data;
+    data.resize(size);
+    size_t len = 0;
+    std::streambuf* buf = f.rdbuf();
+    while (true)
+    {
+        if (len == data.size())
+            data.resize(data.size() * 2);
+        std::streamsize got = buf->sgetn(&data[len], data.size() - len);
+        if (got <= 0)
+            break;
+        len += got;
+    }
+    data.resize(len);
+    return data;
 }
 
 SaveObject* SaveObject::load(std::istream& f)
+{
+    std::string input = read_stream(f);
+    return SaveObject::load(input.data(), input.size());
+}
+
+// Parser over a contiguous buffer. Accepts the same JSON subset as the
+// stream parser below: integers only, and "\n" as the only escape that is
+// translated.
+class SaveObjectParser
+{
+public:
+    const char* pos;
+    const char* end;
+
+    SaveObjectParser(const char* data, size_t size) : pos(data), end(data + size) {}
+
+    [[noreturn]] void error()
+    {
+        throw(std::runtime_error("Parse Error"));
+    }
+
+    void expect(char c)
+    {
+        if (pos >= end || *pos != c)
+            throw(std::runtime_error("Unexpected character"));
+        pos++;
+    }
+
+    void skip_whitespace()
+    {
+        while (pos < end)
+        {
+            char c = *pos;
+            if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+                pos++;
+            else if ((unsigned char)c == 0xEF)
+                pos += 3;
+            else
+                break;
+        }
+        if (pos > end)
+            pos = end;
+    }
+
+    // Returns the first quote or backslash at or after p, or end.
+    const char* scan_string(const char* p)
+    {
+#ifdef __SSE2__
+        const __m128i quote = _mm_set1_epi8('"');
+        const __m128i slash = _mm_set1_epi8('\\');
+        while (p + 16 <= end)
+        {
+            __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+            unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, slash)));
+            if (mask)
+                return p + __builtin_ctz(mask);
+            p += 16;
+        }
+#endif
+        while (p < end && *p != '"' && *p != '\\')
+            p++;
+        return p;
+    }
+
+    // Fast path hands back a view into the buffer; escaped strings are
+    // unpacked into scratch.
+    std::string_view parse_string(std::string& scratch)
+    {
+        expect('"');
+        const char* start = pos;
+        const char* p = scan_string(pos);
+        if (p < end && *p == '"')
+        {
+            pos = p + 1;
+            return std::string_view(start, p - start);
+        }
+        scratch.assign(start, p - start);
+        while (true)
+        {
+            if (p >= end)
+                error();
+            if (*p == '"')
+                break;
+            if (*p == '\\')
+            {
+                p++;
+                if (p >= end)
+                    error();
+                scratch.push_back((*p == 'n') ? '\n' : *p);
+                p++;
+            }
+            const char* next = scan_string(p);
+            scratch.append(p, next - p);
+            p = next;
+        }
+        pos = p + 1;
+        return std::string_view(scratch);
+    }
+
+    int64_t parse_number()
+    {
+        bool neg = false;
+        if (pos < end && *pos == '-')
+        {
+            neg = true;
+            pos++;
+        }
+        if (pos >= end || *pos < '0' || *pos > '9')
+            error();
+        uint64_t v = 0;
+        while (pos < end && *pos >= '0' && *pos <= '9')
+        {
+            v = v * 10 + (*pos - '0');
+            pos++;
+        }
+        return neg ? -int64_t(v) : int64_t(v);
+    }
+
+    void parse_word(const char* word)
+    {
+        for (; *word; word++)
+            expect(*word);
+    }
+
+    SaveObject* parse_value()
+    {
+        skip_whitespace();
+        if (pos >= end)
+            error();
+        char c = *pos;
+        if (c == '{')
+            return parse_map();
+        if (c == '[')
+            return parse_list();
+        if (c == '"')
+        {
+            std::string scratch;
+            return new SaveObjectString(parse_string(scratch));
+        }
+        if ((c >= '0' && c <= '9') || c == '-')
+            return new SaveObjectNumber(parse_number());
+        if (c == 'n')
+        {
+            parse_word("null");
+            return new SaveObjectNull();
+        }
+        if (c == 't')
+        {
+            parse_word("true");
+            return new SaveObjectNumber(1);
+        }
+        if (c == 'f')
+        {
+            parse_word("false");
+            return new SaveObjectNumber(0);
+        }
+        error();
+    }
+
+    SaveObject* parse_map()
+    {
+        SaveObjectMap* omap = new SaveObjectMap;
+        try
+        {
+            expect('{');
+            std::string scratch;
+            while (true)
+            {
+                skip_whitespace();
+                if (pos < end && *pos == '}')
+                    break;
+                std::string_view key = parse_string(scratch);
+                skip_whitespace();
+                expect(':');
+                SaveObject* obj = parse_value();
+                // Saved maps are sorted so the hint makes this constant time.
+                auto it = omap->omap.emplace_hint(omap->omap.end(), key, obj);
+                if (it->second != obj)
+                {
+                    delete it->second;
+                    it->second = obj;
+                }
+                skip_whitespace();
+                if (pos < end && *pos == '}')
+                    break;
+                expect(',');
+            }
+            expect('}');
+        }
+        catch (const std::runtime_error& error)
+        {
+            delete omap;
+            throw;
+        }
+        return omap;
+    }
+
+    SaveObject* parse_list()
+    {
+        SaveObjectList* olist = new SaveObjectList;
+        try
+        {
+            expect('[');
+            while (true)
+            {
+                skip_whitespace();
+                if (pos < end && *pos == ']')
+                    break;
+                olist->olist.push_back(parse_value());
+                skip_whitespace();
+                if (pos < end && *pos == ']')
+                    break;
+                expect(',');
+            }
+            expect(']');
+        }
+        catch (const std::runtime_error& error)
+        {
+            delete olist;
+            throw;
+        }
+        return olist;
+    }
+};
+
+// Binary encoding of the same model. A file starts with binary_magic and a
+// version byte, followed by one value. Each value is a tag byte and then:
+//   BIN_NUMBER  zigzag varint
+//   BIN_STRING  varint length and the bytes
+//   BIN_MAP     varint count, then count key/value pairs
+//   BIN_LIST    varint count, then count values
+// A key is a varint: 0 introduces a new key, written as a length-prefixed
+// string, and n refers back to the nth key introduced so far. Repeated keys
+// such as "square_counts" then cost a byte or two each.
+
+static const char binary_magic[4] = {0, 'B', 'S', 'O'};
+static const uint8_t binary_version = 1;
+
+enum
+{
+    BIN_NULL,
+    BIN_NUMBER,
+    BIN_STRING,
+    BIN_MAP,
+    BIN_LIST,
+};
+
+class SaveObjectBinaryWriter
+{
+public:
+    std::string out;
+    std::ostream* sink = NULL;
+    std::unordered_map<std::string_view, unsigned> keys;
+
+    // With a sink, out only stages the output and is handed on as it fills.
+    void spill(size_t limit = 1 << 16)
+    {
+        if (sink && out.size() >= limit)
+        {
+            sink->write(out.data(), out.size());
+            out.clear();
+        }
+    }
+
+    void put_varint(uint64_t v)
+    {
+        while (v >= 0x80)
+        {
+            out.push_back(char(v | 0x80));
+            v >>= 7;
+        }
+        out.push_back(char(v));
+    }
+
+    void put_string(std::string_view str)
+    {
+        put_varint(str.size());
+        out.append(str);
+    }
+
+    void put_value(SaveObject* obj)
+    {
+        spill();
+        if (obj->is_num())
+        {
+            int64_t n = obj->get_num();
+            out.push_back(BIN_NUMBER);
+            put_varint((uint64_t(n) << 1) ^ uint64_t(n >> 63));
+        }
+        else if (obj->is_string())
+        {
+            out.push_back(BIN_STRING);
+            put_string(((SaveObjectString*)obj)->str);
+        }
+        else if (obj->is_map())
+        {
+            SaveObjectMap* omap = obj->get_map();
+            out.push_back(BIN_MAP);
+            put_varint(omap->omap.size());
+            for (auto& [key, value] : omap->omap)
+            {
+                auto [it, inserted] = keys.emplace(std::string_view(key), keys.size() + 1);
+                if (inserted)
+                {
+                    put_varint(0);
+                    put_string(key);
+                }
+                else
+                    put_varint(it->second);
+                put_value(value);
+            }
+        }
+        else if (obj->is_list())
+        {
+            SaveObjectList* olist = obj->get_list();
+            out.push_back(BIN_LIST);
+            put_varint(olist->olist.size());
+            for (SaveObject* value : olist->olist)
+                put_value(value);
+        }
+        else
+            out.push_back(BIN_NULL);
+    }
+};
+
+class SaveObjectBinaryParser
+{
+public:
+    const char* pos;
+    const char* end;
+    std::vector<std::string_view> keys;
+
+    SaveObjectBinaryParser(const char* data, size_t size) : pos(data), end(data + size) {}
+
+    [[noreturn]] void error()
+    {
+        throw(std::runtime_error("Parse Error"));
+    }
+
+    uint64_t get_varint()
+    {
+        uint64_t v = 0;
+        for (int shift = 0; shift < 64; shift += 7)
+        {
+            if (pos >= end)
+                error();
+            uint8_t c = *pos++;
+            v |= uint64_t(c & 0x7F) << shift;
+            if (!(c & 0x80))
+                return v;
+        }
+        error();
+    }
+
+    std::string_view get_string()
+    {
+        uint64_t len = get_varint();
+        if (len > uint64_t(end - pos))
+            error();
+        std::string_view str(pos, len);
+        pos += len;
+        return str;
+    }
+
+    // Every element takes at least one byte, so a count larger than the rest
+    // of the input is corrupt and must not be used to reserve memory.
+    uint64_t get_count()
+    {
+        uint64_t count = get_varint();
+        if (count > uint64_t(end - pos))
+            error();
+        return count;
+    }
+
+    SaveObject* parse_value()
+    {
+        if (pos >= end)
+            error();
+        switch (*pos++)
+        {
+            case BIN_NULL:
+                return new SaveObjectNull();
+            case BIN_NUMBER:
+            {
+                uint64_t v = get_varint();
+                return new SaveObjectNumber(int64_t(v >> 1) ^ -int64_t(v & 1));
+            }
+            case BIN_STRING:
+                return new SaveObjectString(get_string());
+            case BIN_MAP:
+                return parse_map();
+            case BIN_LIST:
+                return parse_list();
+        }
+        error();
+    }
+
+    SaveObject* parse_map()
+    {
+        SaveObjectMap* omap = new SaveObjectMap;
+        try
+        {
+            uint64_t count = get_count();
+            for (uint64_t i = 0; i < count; i++)
+            {
+                uint64_t ref = get_varint();
+                std::string_view key;
+                if (ref == 0)
+                {
+                    key = get_string();
+                    keys.push_back(key);
+                }
+                else if (ref <= keys.size())
+                    key = keys[ref - 1];
+                else
+                    error();
+                SaveObject* obj = parse_value();
+                auto it = omap->omap.emplace_hint(omap->omap.end(), key, obj);
+                if (it->second != obj)
+                {
+                    delete it->second;
+                    it->second = obj;
+                }
+            }
+        }
+        catch (const std::runtime_error& error)
+        {
+            delete omap;
+            throw;
+        }
+        return omap;
+    }
+
+    SaveObject* parse_list()
+    {
+        SaveObjectList* olist = new SaveObjectList;
+        try
+        {
+            uint64_t count = get_count();
+            olist->olist.reserve(count);
+            for (uint64_t i = 0; i < count; i++)
+                olist->olist.push_back(parse_value());
+        }
+        catch (const std::runtime_error& error)
+        {
+            delete olist;
+            throw;
+        }
+        return olist;
+    }
+};
+
+bool SaveObject::is_binary(const char* data, size_t size)
+{
+    return size >= sizeof(binary_magic) && !memcmp(data, binary_magic, sizeof(binary_magic));
+}
+
+std::string SaveObject::to_binary()
+{
+    SaveObjectBinaryWriter writer;
+    writer.out.append(binary_magic, sizeof(binary_magic));
+    writer.out.push_back(binary_version);
+    writer.put_value(this);
+    return writer.out;
+}
+
+void SaveObject::save_binary(std::ostream& f)
+{
+    SaveObjectBinaryWriter writer;
+    writer.sink = &f;
+    writer.out.append(binary_magic, sizeof(binary_magic));
+    writer.out.push_back(binary_version);
+    writer.put_value(this);
+    writer.spill(0);
+}
+
+SaveObject* SaveObject::load(const char* data, size_t size)
+{
+    SaveArena::Scope scope(size * 2 + 1024);
+    if (is_binary(data, size))
+    {
+        if (size <= sizeof(binary_magic) || uint8_t(data[sizeof(binary_magic)]) != binary_version)
+            throw(std::runtime_error("Unknown binary save version"));
+        SaveObjectBinaryParser parser(data + sizeof(binary_magic) + 1, size - sizeof(binary_magic) - 1);
+        return scope.finish(parser.parse_value());
+    }
+    SaveObjectParser parser(data, size);
+    return scope.finish(parser.parse_value());
+}
+
+SaveObject* SaveObject::parse_stream(std::istream& f)
 {
     skip_whitespace(f);
     char c = f.peek();
@@ -84,20 +712,21 @@ static std::string parse_string(std::istream& f)
     }
     return str;
 }
-SaveObjectString::SaveObjectString(std::istream& f)
+SaveObjectString::SaveObjectString(std::istream& f):
+    str(SaveArena::resource())
 {
     str = parse_string(f);
 }
 
 std::string SaveObjectString::get_string()
 {
-    return str;
+    return std::string(str);
 }
 
 void SaveObjectString::save(std::ostream& f)
 {
     f << '"';
-    for(std::string::iterator it = str.begin(); it != str.end(); ++it)
+    for(std::pmr::string::iterator it = str.begin(); it != str.end(); ++it)
     {
         char c = *it;
         if (c == '\n')
@@ -112,7 +741,8 @@ void SaveObjectString::save(std::ostream& f)
     f << '"';
 }
 
-SaveObjectMap::SaveObjectMap(std::istream& f)
+SaveObjectMap::SaveObjectMap(std::istream& f):
+    omap(SaveArena::resource())
 {
     assert_exp('{');
     while (true)
@@ -123,7 +753,7 @@ SaveObjectMap::SaveObjectMap(std::istream& f)
         std::string key = parse_string(f);
         skip_whitespace(f);
         assert_exp(':');
-        SaveObject* obj = SaveObject::load(f);
+        SaveObject* obj = SaveObject::parse_stream(f);
         add_item(key, obj);
         skip_whitespace(f);
         if (f.peek() == '}')
@@ -134,62 +764,60 @@ SaveObjectMap::SaveObjectMap(std::istream& f)
 }
 SaveObjectMap::~SaveObjectMap()
 {
-    for(std::map<std::string, SaveObject*>::iterator it = omap.begin();it != omap.end();++it)
+    for(SaveObjectMap::Map::iterator it = omap.begin();it != omap.end();++it)
         delete it->second;
 }
 
-void SaveObjectMap::add_item(std::string key, SaveObject* value)
+void SaveObjectMap::add_item(std::string_view key, SaveObject* value)
 {
-    assert(!omap[key]);
-    omap[key]=value;
+    auto [it, inserted] = omap.emplace(key, value);
+    assert(inserted);
+    if (!inserted)
+        it->second = value;
 }
 
-SaveObject* SaveObjectMap::get_item(std::string key)
+SaveObject* SaveObjectMap::get_item(std::string_view key)
 {
-    if (omap.find(key) == omap.end())
+    Map::iterator it = omap.find(key);
+    if (it == omap.end())
     {
         std::cout << key << "\n";
         throw(std::runtime_error("Bad map key"));
     }
-    return omap[key];
+    return it->second;
 }
 
-int64_t SaveObjectMap::get_num(std::string key)
+int64_t SaveObjectMap::get_num(std::string_view key)
 {
-    if (omap.find(key) != omap.end())
-        return omap[key]->get_num();
+    Map::iterator it = omap.find(key);
+    if (it != omap.end())
+        return it->second->get_num();
     std::cout << "failed indexing for an int with key:" << key << "\n";
     return 0;
 }
-void SaveObjectMap::get_num(std::string key, int& value)
+void SaveObjectMap::get_num(std::string_view key, int& value)
 {
-    if (omap.find(key) == omap.end())
-        throw(std::runtime_error("Bad map key"));
-    value = omap[key]->get_num();
+    value = get_item(key)->get_num();
 }
-void SaveObjectMap::add_num(std::string key, int64_t value)
+void SaveObjectMap::add_num(std::string_view key, int64_t value)
 {
     add_item(key, new SaveObjectNumber(value));
 }
-void SaveObjectMap::add_string(std::string key, std::string value)
+void SaveObjectMap::add_string(std::string_view key, std::string_view value)
 {
     add_item(key, new SaveObjectString(value));
 }
-void SaveObjectMap::get_string(std::string key, std::string& value)
+void SaveObjectMap::get_string(std::string_view key, std::string& value)
 {
-    if (omap.find(key) == omap.end())
-        throw(std::runtime_error("Bad map key"));
-    value = omap[key]->get_string();
+    value = get_item(key)->get_string();
 }
 
-std::string SaveObjectMap::get_string(std::string key)
+std::string SaveObjectMap::get_string(std::string_view key)
 {
-    if (omap.find(key) == omap.end())
-        throw(std::runtime_error("Bad map key"));
-    return omap[key]->get_string();
+    return get_item(key)->get_string();
 }
 
-bool SaveObjectMap::has_key(std::string key)
+bool SaveObjectMap::has_key(std::string_view key)
 {
     return omap.find(key) != omap.end();
 }
@@ -198,7 +826,7 @@ void SaveObjectMap::save(std::ostream& f)
 {
     f.put('{');
     bool first = true;
-    for (std::map<std::string, SaveObject*>::iterator it=omap.begin(); it!=omap.end(); ++it)
+    for (SaveObjectMap::Map::iterator it=omap.begin(); it!=omap.end(); ++it)
     {
         if (!first)
             f << ',';
@@ -219,7 +847,7 @@ void SaveObjectMap::pretty_print(std::ostream& f, int indent)
     f << std::string(indent, ' ');
     f.put('{');
     bool first = true;
-    for (std::map<std::string, SaveObject*>::iterator it=omap.begin(); it!=omap.end(); ++it)
+    for (SaveObjectMap::Map::iterator it=omap.begin(); it!=omap.end(); ++it)
     {
         if (!first)
             f << ',';
@@ -241,14 +869,15 @@ void SaveObjectMap::pretty_print(std::ostream& f, int indent)
 SaveObject* SaveObjectMap::dup()
 {
     SaveObjectMap* rep = new SaveObjectMap;
-    for (std::map<std::string, SaveObject*>::iterator it=omap.begin(); it!=omap.end(); ++it)
+    for (SaveObjectMap::Map::iterator it=omap.begin(); it!=omap.end(); ++it)
     {
-        rep->add_item(it->first, it->second->dup());
+        rep->add_item(std::string(it->first), it->second->dup());
     }
     return rep;
 };
 
-SaveObjectList::SaveObjectList(std::istream& f)
+SaveObjectList::SaveObjectList(std::istream& f):
+    olist(SaveArena::resource())
 {
     assert_exp('[');
     while (true)
@@ -256,7 +885,7 @@ SaveObjectList::SaveObjectList(std::istream& f)
         skip_whitespace(f);
         if (f.peek() == ']')
             break;
-        SaveObject* obj = SaveObject::load(f);
+        SaveObject* obj = SaveObject::parse_stream(f);
         add_item(obj);
         skip_whitespace(f);
         if (f.peek() == ']')
@@ -268,7 +897,7 @@ SaveObjectList::SaveObjectList(std::istream& f)
 
 SaveObjectList::~SaveObjectList()
 {
-    for(std::vector<SaveObject*>::iterator it = olist.begin(); it != olist.end(); it++)
+    for(std::pmr::vector<SaveObject*>::iterator it = olist.begin(); it != olist.end(); it++)
         delete *it;
 }
 
@@ -303,7 +932,7 @@ void SaveObjectList::save(std::ostream& f)
 {
     f.put('[');
     bool first = true;
-    for (std::vector<SaveObject*>::iterator it=olist.begin(); it!=olist.end(); ++it)
+    for (std::pmr::vector<SaveObject*>::iterator it=olist.begin(); it!=olist.end(); ++it)
     {
         if (!first)
             f << ',';
@@ -317,7 +946,7 @@ void SaveObjectList::pretty_print(std::ostream& f, int indent)
 {
     f.put('[');
     bool first = true;
-    for (std::vector<SaveObject*>::iterator it=olist.begin(); it!=olist.end(); ++it)
+    for (std::pmr::vector<SaveObject*>::iterator it=olist.begin(); it!=olist.end(); ++it)
     {
         if (!first)
             f << ',';
@@ -327,7 +956,7 @@ void SaveObjectList::pretty_print(std::ostream& f, int indent)
     f.put(']');
 }
 
-void SaveObjectList::add_string(std::string value)
+void SaveObjectList::add_string(std::string_view value)
 {
     add_item(new SaveObjectString(value));
 }
@@ -343,7 +972,7 @@ std::string SaveObjectList::get_string(int index)
 SaveObject* SaveObjectList::dup()
 {
     SaveObjectList* rep = new SaveObjectList;
-    for (std::vector<SaveObject*>::iterator it=olist.begin(); it!=olist.end(); ++it)
+    for (std::pmr::vector<SaveObject*>::iterator it=olist.begin(); it!=olist.end(); ++it)
     {
         rep->add_item((*it)->dup());
     }
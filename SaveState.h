@@ -7,21 +7,81 @@
 #include <string>
 #include <iostream>
 #include <sstream>
+#include <memory_resource>
+#include <string_view>
 
 class SaveObjectMap;
 class SaveObjectList;
 class SaveObjectNull;
 
+class SaveObject;
+
+// Reads the rest of a stream into one string. Seekable streams are sized up
+// front; others are read in large blocks rather than a character at a time.
+std::string read_stream(std::istream& f);
+
+// Bump allocator for SaveObject trees. While a SaveArena::Scope is active
+// on a thread, SaveObject nodes and their maps, lists and strings created
+// on that thread are carved out of the arena. The root passed to
+// Scope::finish owns the arena and frees it in one go when deleted; deleting
+// any other node from the arena is a no-op.
+class SaveArena : public std::pmr::memory_resource
+{
+public:
+    SaveArena(size_t block_size);
+    ~SaveArena();
+    size_t used() {return total_used;}
+    static std::pmr::memory_resource* resource();
+    static SaveArena* current();
+
+    class Scope
+    {
+    public:
+        Scope(size_t size_hint = 1 << 16);
+        ~Scope();
+        size_t used() {return arena->used();}
+        template<class T> T* finish(T* root) {adopt(root); return root;}
+    private:
+        void adopt(SaveObject* root);
+        SaveArena* arena;
+        SaveArena* prev;
+        bool finished = false;
+    };
+
+protected:
+    void* do_allocate(size_t bytes, size_t alignment);
+    void do_deallocate(void* p, size_t bytes, size_t alignment) {}
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept {return this == &other;}
+
+private:
+    struct Block
+    {
+        Block* next;
+    };
+    Block* blocks = NULL;
+    char* pos = NULL;
+    char* end = NULL;
+    size_t block_size;
+    size_t total_used = 0;
+};
+
 class SaveObject
 {
 public:
     SaveObject(){};
     virtual ~SaveObject(){};
+    static void* operator new(size_t size);
+    static void operator delete(void* ptr);
     virtual void save(std::ostream& f)=0;
     virtual void pretty_print(std::ostream& f, int indent = 0)=0;
     std::string to_string();
+    void save_binary(std::ostream& f);
+    std::string to_binary();
+    static bool is_binary(const char* data, size_t size);
     static SaveObject* load(std::string& input);
     static SaveObject* load(std::istream& f);
+    static SaveObject* load(const char* data, size_t size);
+    static SaveObject* parse_stream(std::istream& f);
     virtual int64_t get_num(){throw(std::runtime_error("Not a num"));};
     virtual std::string get_string(){throw(std::runtime_error("Not a string"));};
     virtual SaveObjectMap* get_map(){throw(std::runtime_error("Not a map"));};
@@ -52,8 +112,8 @@ class SaveObjectString :
     public SaveObject
 {
 public:
-    std::string str;
-    SaveObjectString(std::string str_):str(str_){};
+    std::pmr::string str;
+    SaveObjectString(std::string_view str_):str(str_, SaveArena::resource()){};
     SaveObjectString(std::istream& stream);
     std::string get_string();
     void save(std::ostream& f);
@@ -66,25 +126,26 @@ class SaveObjectMap :
     public SaveObject
 {
 public:
-    std::map<std::string, SaveObject*> omap;
+    typedef std::pmr::map<std::pmr::string, SaveObject*, std::less<>> Map;
+    Map omap;
 
-    SaveObjectMap(){};
+    SaveObjectMap():omap(SaveArena::resource()){};
     virtual ~SaveObjectMap();
     SaveObjectMap(std::istream& f);
     void save(std::ostream& f);
     void pretty_print(std::ostream& f, int indent = 0);
     SaveObjectMap* get_map(){return this;};
     
-    void add_item(std::string key, SaveObject* value);
-    SaveObject* get_item(std::string key);
-    int64_t get_num(std::string key);
-    void get_num(std::string key, int& value);
-    void add_num(std::string key, int64_t value);
-    void add_string(std::string key, std::string value);
-    void get_string(std::string key, std::string& value);
+    void add_item(std::string_view key, SaveObject* value);
+    SaveObject* get_item(std::string_view key);
+    int64_t get_num(std::string_view key);
+    void get_num(std::string_view key, int& value);
+    void add_num(std::string_view key, int64_t value);
+    void add_string(std::string_view key, std::string_view value);
+    void get_string(std::string_view key, std::string& value);
     using SaveObject::get_string;
-    std::string get_string(std::string key);
-    bool has_key(std::string key);
+    std::string get_string(std::string_view key);
+    bool has_key(std::string_view key);
     SaveObject* dup();
     virtual bool is_map(){return true;};
     unsigned get_count(){return omap.size();}
@@ -95,9 +156,9 @@ class SaveObjectList :
     public SaveObject
 {
 public:
-    std::vector<SaveObject*> olist;
+    std::pmr::vector<SaveObject*> olist;
 
-    SaveObjectList(){};
+    SaveObjectList():olist(SaveArena::resource()){};
     SaveObjectList(std::istream& f);
     ~SaveObjectList();
     void save(std::ostream& f);
@@ -109,7 +170,7 @@ public:
     unsigned get_count();
     void add_num(int64_t value);
     int64_t get_num(int index);
-    void add_string(std::string value);
+    void add_string(std::string_view value);
     using SaveObject::get_string;
     std::string get_string(int index);
     SaveObject* dup();
@@ -0,0 +1,151 @@
+#include "SaveWriter.h"
+#include "Compress.h"
+
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <stdio.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+// An ostream over a FILE*, which is kept so the file can be synced before
+// it is renamed into place.
+class FileStreamBuf : public std::streambuf
+{
+public:
+    FileStreamBuf(FILE* f_) : f(f_) {}
+protected:
+    std::streamsize xsputn(const char* s, std::streamsize n) {return fwrite(s, 1, n, f);}
+    int overflow(int c) {return (c == EOF) ? 0 : fputc(c, f);}
+private:
+    FILE* f;
+};
+
+bool write_file_atomic(const std::string& filename, const std::function<void(std::ostream&)>& write)
+{
+    std::string tmp_filename = filename + ".tmp";
+#ifdef _WIN32
+    FILE* f = _wfopen(std::filesystem::path((char8_t*)tmp_filename.c_str()).c_str(), L"wb");
+#else
+    FILE* f = fopen(tmp_filename.c_str(), "wb");
+#endif
+    if (!f)
+    {
+        std::cerr << "Could not open " << tmp_filename << "\n";
+        return false;
+    }
+    FileStreamBuf buf(f);
+    std::ostream stream(&buf);
+    write(stream);
+    bool ok = stream.good();
+    ok = ok && (fflush(f) == 0);
+#ifdef _WIN32
+    ok = ok && (_commit(_fileno(f)) == 0);
+#else
+    ok = ok && (fsync(fileno(f)) == 0);
+#endif
+    fclose(f);
+    if (!ok)
+    {
+        std::cerr << "Failed to write " << tmp_filename << "\n";
+        return false;
+    }
+    std::error_code ec;
+    std::filesystem::rename(std::filesystem::path((char8_t*)tmp_filename.c_str()), std::filesystem::path((char8_t*)filename.c_str()), ec);
+    if (ec)
+    {
+        std::cerr << "Failed to rename " << tmp_filename << ": " << ec.message() << "\n";
+        return false;
+    }
+    return true;
+}
+
+
+static int save_writer_thread_func(void *ptr)
+{
+    ((SaveWriter*)ptr)->thread_func();
+    return 0;
+}
+
+SaveWriter::SaveWriter()
+{
+    mutex = SDL_CreateMutex();
+    cond = SDL_CreateCond();
+    thread = SDL_CreateThread(save_writer_thread_func, "SaveWriter", (void *)this);
+}
+
+SaveWriter::~SaveWriter()
+{
+    flush();
+    SDL_LockMutex(mutex);
+    shutdown = true;
+    SDL_CondBroadcast(cond);
+    SDL_UnlockMutex(mutex);
+    SDL_WaitThread(thread, NULL);
+    SDL_DestroyCond(cond);
+    SDL_DestroyMutex(mutex);
+}
+
+void SaveWriter::write(SaveObject* sob, std::vector<std::string> filenames, Format format, CompressProfile profile)
+{
+    SDL_LockMutex(mutex);
+    jobs.push_back(Job{sob, filenames, format, profile});
+    SDL_CondBroadcast(cond);
+    SDL_UnlockMutex(mutex);
+}
+
+void SaveWriter::flush()
+{
+    SDL_LockMutex(mutex);
+    while (!jobs.empty() || busy)
+        SDL_CondWait(cond, mutex);
+    SDL_UnlockMutex(mutex);
+}
+
+void SaveWriter::thread_func()
+{
+    SDL_SetThreadPriority(SDL_THREAD_PRIORITY_LOW);
+    SDL_LockMutex(mutex);
+    while (true)
+    {
+        while (jobs.empty() && !shutdown)
+            SDL_CondWait(cond, mutex);
+        if (jobs.empty())
+            break;
+        Job job = jobs.front();
+        jobs.pop_front();
+        busy = true;
+        SDL_UnlockMutex(mutex);
+
+        // Serialised and compressed straight into the first file; any
+        // others are copies of it.
+        bool ok = write_file_atomic(job.filenames[0], [&](std::ostream& stream)
+        {
+            if (job.format == FORMAT_PRETTY)
+            {
+                job.sob->pretty_print(stream);
+                return;
+            }
+            CompressOStream zstream(stream, job.profile);
+            if (job.format == FORMAT_BINARY)
+                job.sob->save_binary(zstream);
+            else
+                job.sob->save(zstream);
+            zstream.finish();
+        });
+        delete job.sob;
+        for (size_t i = 1; ok && i < job.filenames.size(); i++)
+        {
+            std::ifstream source(std::filesystem::path((char8_t*)job.filenames[0].c_str()), std::ios::binary);
+            write_file_atomic(job.filenames[i], [&](std::ostream& stream) {stream << source.rdbuf();});
+        }
+
+        SDL_LockMutex(mutex);
+        busy = false;
+        SDL_CondBroadcast(cond);
+    }
+    SDL_UnlockMutex(mutex);
+}
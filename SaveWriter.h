@@ -0,0 +1,49 @@
+#pragma once
+#include "SaveState.h"
+#include "Compress.h"
+
+#include <SDL.h>
+#include <functional>
+#include <list>
+#include <string>
+#include <vector>
+
+// Background writer for the autosave. The main thread hands over a
+// SaveObject snapshot and the writer thread serialises, compresses and
+// writes it, replacing each destination with an atomic rename.
+
+class SaveWriter
+{
+public:
+    enum Format
+    {
+        FORMAT_BINARY,
+        FORMAT_COMPRESSED,
+        FORMAT_PRETTY,
+    };
+
+    SaveWriter();
+    ~SaveWriter();
+    void write(SaveObject* sob, std::vector<std::string> filenames, Format format = FORMAT_BINARY, CompressProfile profile = COMPRESS_ARCHIVE);
+    void flush();
+    void thread_func();
+
+private:
+    class Job
+    {
+    public:
+        SaveObject* sob;
+        std::vector<std::string> filenames;
+        Format format;
+        CompressProfile profile;
+    };
+
+    SDL_Thread* thread = NULL;
+    SDL_mutex* mutex = NULL;
+    SDL_cond* cond = NULL;
+    std::list<Job> jobs;
+    bool busy = false;
+    bool shutdown = false;
+};
+
+bool write_file_atomic(const std::string& filename, const std::function<void(std::ostream&)>& write);
@@ -193,7 +193,7 @@ void* exec(void* dummy)
             if ((int)second_global_level_sets[j].size() <= cnt)
                 second_global_level_sets[j].push_back(new LevelSet());
 
-            for (std::string& s : second_global_level_sets[j][cnt]->levels)
+            for (std::string& s : second_global_level_sets[j][cnt]->get_levels())
             {
                 if (s == "")
                     continue;
@@ -203,9 +203,9 @@ void* exec(void* dummy)
                 delete grid;
             }
 
-            while ((int)second_global_level_sets[j][cnt]->levels.size() < params[i].cnt)
+            while ((int)second_global_level_sets[j][cnt]->get_levels().size() < params[i].cnt)
             {
-                printf("%lu of %d\n", second_global_level_sets[j][cnt]->levels.size(), params[i].cnt);
+                printf("%lu of %d\n", second_global_level_sets[j][cnt]->get_levels().size(), params[i].cnt);
                 pthread_mutex_unlock(&glob_mutex);
                 const char* req = params[i].pars;
                 Grid* g;
@@ -249,7 +249,7 @@ void* exec(void* dummy)
                 g->randomize(siz, Grid::WrapType(wrap), merged, rows, 0);
                 g->make_harder(pm, xy, xy3, xyz, exc, parity, xor1, xor11, prime);
 
-                std::string s = g->to_string();
+                std::string s = g->to_packed();
                 {
                     Grid* gt = Grid::Load(s);
                     assert(gt->is_solveable());
@@ -257,7 +257,7 @@ void* exec(void* dummy)
                 }
                 pthread_mutex_lock(&glob_mutex);
 
-                std::vector<std::string> &levels = second_global_level_sets[j][cnt]->levels;
+                std::vector<std::string> &levels = second_global_level_sets[j][cnt]->get_levels();
                 // if (g->uses_neg_bombs())
                     if(std::find(levels.begin(), levels.end(), s) == levels.end())
                         levels.push_back(s);
@@ -265,7 +265,7 @@ void* exec(void* dummy)
                 LevelSet::save_global();
                 printf("got\n");
             }
-            second_global_level_sets[j][cnt]->levels.resize(params[i].cnt);
+            second_global_level_sets[j][cnt]->get_levels().resize(params[i].cnt);
             cnt++;
         }
         second_global_level_sets[j].resize(cnt);
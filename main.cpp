@@ -11,6 +11,7 @@
 #include "Grid.h"
 #include "GameState.h"
 #include "Compress.h"
+#include "SaveWriter.h"
 
 #ifdef _WIN32
     #include <filesystem>
@@ -134,6 +135,8 @@ void mainloop()
 #else
     std::string save_filename = std::string(save_path) + "test_bombe.save";
 #endif
+    std::string robot_cache_filename = std::string(save_path) + "robots.cache";
+    std::string rule_profile_filename = std::string(save_path) + "rule_profile.json";
 
     SDL_free(save_path);
 
@@ -144,21 +147,13 @@ void mainloop()
 #else
         std::ifstream loadfile(save_filename.c_str());
 #endif
-        std::stringstream str_stream;
-        str_stream << loadfile.rdbuf();
-        std::string str = str_stream.str();
-        bool json = true;
-        try
-        {
-            str = decompress_string(str);
-            json = false;
-        }
-        catch (const std::runtime_error& error)
-        {
-            std::cerr << error.what() << "\n";
-        }
-
-        game_state = new GameState(str, json);
+        bool json = !is_zstd_stream(loadfile);
+        DecompressIStream zloadfile(loadfile);
+        if (json)
+            game_state = new GameState(loadfile, json);
+        else
+            game_state = new GameState(zloadfile, json);
+        game_state->robot_cache.load(robot_cache_filename);
     }
 #ifdef STEAM
     SteamGameManager steam_manager;
@@ -181,10 +176,13 @@ void mainloop()
                                                (std::istreambuf_iterator<char>()));
     }
 
+    SaveWriter save_writer;
     int save_time = 0;
     unsigned oldtime = SDL_GetTicks();
 	while(true)
 	{
+        unsigned frame_start = SDL_GetTicks();
+        bool saved = false;
 #ifdef STEAM
         if (game_state->pirate)
             steam_manager.get_new_ticket();
@@ -201,22 +199,13 @@ void mainloop()
         {
             game_state->fetch_scores();
             game_state->render(true);
-            SaveObject* omap = game_state->save();
             std::string my_save_filename = save_filename + std::to_string(save_index);
             save_index = (save_index + 1) % 10;
-            std::string out_data = compress_string(omap->to_string());
-
-#ifdef _WIN32
-            std::ofstream outfile1 (std::filesystem::path((char8_t*)save_filename.c_str()), std::ios::binary);
-            std::ofstream outfile2 (std::filesystem::path((char8_t*)my_save_filename.c_str()), std::ios::binary);
-#else
-            std::ofstream outfile1 (save_filename.c_str());
-            std::ofstream outfile2 (my_save_filename.c_str());
-#endif
-            outfile1 << out_data;
-            outfile2 << out_data;
-            delete omap;
+            save_writer.write(game_state->save(), {save_filename, my_save_filename});
+            save_writer.write(game_state->robot_cache.save(), {robot_cache_filename}, SaveWriter::FORMAT_BINARY, COMPRESS_INTERACTIVE);
+            save_writer.write(game_state->save_rule_profile(), {rule_profile_filename}, SaveWriter::FORMAT_PRETTY);
             save_time = 1000 * 60;
+            saved = true;
         }
         else
         {
@@ -224,6 +213,7 @@ void mainloop()
         }
 
         unsigned newtime = SDL_GetTicks();
+        unsigned frame_time = newtime - frame_start;
         unsigned diff = newtime - oldtime;
         if (diff > 1000)
             diff = 1000;
@@ -234,21 +224,17 @@ void mainloop()
             diff = newtime - oldtime;
         }
         save_time -= diff;
+        unsigned advance_start = SDL_GetTicks();
         game_state->advance(diff);
+        frame_time += SDL_GetTicks() - advance_start;
+        if (!saved)
+            game_state->throttle_robots(frame_time, diff);
         oldtime = newtime;
 	}
     SDL_HideWindow(game_state->sdl_window);
-    {
-        SaveObject* omap = game_state->save();
-        std::string out_data = compress_string(omap->to_string());
-#ifdef _WIN32
-        std::ofstream outfile1 (std::filesystem::path((char8_t*)save_filename.c_str()), std::ios::binary);
-#else
-        std::ofstream outfile1 (save_filename.c_str());
-#endif
-        outfile1 << out_data;
-        delete omap;
-    }
+    save_writer.write(game_state->save(), {save_filename});
+    save_writer.write(game_state->robot_cache.save(), {robot_cache_filename}, SaveWriter::FORMAT_BINARY, COMPRESS_INTERACTIVE);
+    save_writer.flush();
     delete game_state;
 }
 